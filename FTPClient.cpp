@@ -1,4 +1,33 @@
 #include "FTPClient.h"
+#include <new>
+
+// "YYYYMMDDHHMMSS" (e.g. of a MDTM reply) to a timestamp, 0 if malformed.
+// Days since the epoch are calculated with H. Hinnant's days_from_civil() algorithm
+static time_t parseModTime(const char *s)
+{
+  static const uint8_t width[6] = {4, 2, 2, 2, 2, 2};
+  uint16_t v[6]; // year, month, day, hour, minute, second
+  for (uint8_t i = 0; i < 6; ++i)
+  {
+    v[i] = 0;
+    for (uint8_t n = 0; n < width[i]; ++n, ++s)
+    {
+      if (*s < '0' || *s > '9')
+        return 0;
+      v[i] = v[i] * 10 + (*s - '0');
+    }
+  }
+  if (v[0] < 1970 || v[1] < 1 || v[1] > 12)
+    return 0;
+
+  uint32_t y = v[0] - (v[1] <= 2);
+  uint32_t era = y / 400;
+  uint32_t yoe = y - era * 400;
+  uint32_t doy = (153 * ((v[1] > 2) ? v[1] - 3 : v[1] + 9) + 2) / 5 + v[2] - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  uint32_t days = era * 146097 + doe - 719468;
+  return (time_t)days * 86400 + v[3] * 3600 + v[4] * 60 + v[5];
+}
 
 FTPClient::FTPClient(FS &_FSImplementation) : FTPCommon(_FSImplementation)
 {
@@ -6,6 +35,11 @@ FTPClient::FTPClient(FS &_FSImplementation) : FTPCommon(_FSImplementation)
   aTimeout.resetToNeverExpires();
 }
 
+FTPClient::~FTPClient()
+{
+  endSegments();
+}
+
 void FTPClient::begin(const ServerInfo &theServer)
 {
   _server = &theServer;
@@ -13,13 +47,30 @@ void FTPClient::begin(const ServerInfo &theServer)
 
 const FTPClient::Status &FTPClient::transfer(const String &localFileName, const String &remoteFileName, TransferType direction)
 {
+  // let a keepalive NOOP finish first
+  while (cNoop == ftpState)
+  {
+    handleFTP();
+    delay(1);
+  }
+
   _serverStatus.result = PROGRESS;
   if (ftpState >= cIdle)
   {
     _remoteFileName = remoteFileName;
     _direction = direction;
+    _command = 0;
 
-    if (direction & FTP_GET_NONBLOCKING)
+    _restartOffset = 0;
+    _segmentedGet = (_segments > 1) && ((direction & 0x7f) == FTP_GET_NONBLOCKING);
+    if ((direction & FTP_GET_RESUME_NONBLOCKING) == FTP_GET_RESUME_NONBLOCKING)
+    {
+      // keep what we have, the server sends the rest of the file
+      file = THEFS.open(localFileName, "a");
+      if (file)
+        _restartOffset = file.size();
+    }
+    else if (direction & FTP_GET_NONBLOCKING)
       file = THEFS.open(localFileName, "w");
     else if (direction & FTP_PUT_NONBLOCKING)
       file = THEFS.open(localFileName, "r");
@@ -29,18 +80,15 @@ const FTPClient::Status &FTPClient::transfer(const String &localFileName, const
       _serverStatus.result = ERROR;
       _serverStatus.code = errorLocalFile;
       _serverStatus.desc = F("Local file error");
+      dropPendingPasv();
     }
     else
     {
-      ftpState = cConnect;
+      if (needsSize())
+        dropPendingPasv();
+      startSession();
       if (direction & 0x80)
-      {
-        while (ftpState <= cQuit)
-        {
-          handleFTP();
-          delay(25);
-        }
-      }
+        waitDone();
     }
   }
   else
@@ -51,27 +99,489 @@ const FTPClient::Status &FTPClient::transfer(const String &localFileName, const
   return _serverStatus;
 }
 
+void FTPClient::startSession()
+{
+  // drop stale replies (e.g. a 421 timeout) of an idle connection,
+  // unless the reply to an early PASV is waiting (or still to be skipped)
+  if (!_pasvPending && !_skipReplies)
+  {
+    while (control.available())
+      control.read();
+    _replyLine.clear();
+    _multiLineCode = 0;
+  }
+  // re-use the logged in control connection if there is one
+  _sessionReused = _loggedIn && control.connected();
+  if (!_sessionReused)
+    ftpState = cConnect;
+  else if (_pasvPending)
+    ftpState = cPassive;
+  else
+    ftpState = cStart;
+  _pasvPending = false;
+}
+
+bool FTPClient::needsSize() const
+{
+  return ((_direction & FTP_PUT_RESUME_NONBLOCKING) == FTP_PUT_RESUME_NONBLOCKING) ||
+         ((_direction & FTP_PUT_SYNC_NONBLOCKING) == FTP_PUT_SYNC_NONBLOCKING) || _segmentedGet;
+}
+
+void FTPClient::dropPendingPasv()
+{
+  // its 227 reply is read and ignored, so it is not taken for the reply to the next command
+  if (_pasvPending)
+  {
+    FTP_DEBUG_MSG("Early PASV not used");
+    _pasvPending = false;
+    ++_skipReplies;
+  }
+}
+
+// send a command instead of transferring a file (non-blocking)
+void FTPClient::startCommand(uint32_t command, const String &remoteName, const String &renameTo, bool ignoreExisting)
+{
+  _serverStatus.result = PROGRESS;
+  _remoteFileName = remoteName;
+  _command = command;
+  _renameTo = renameTo;
+  _ignoreExisting = ignoreExisting;
+  _restartOffset = 0;
+  _segmentedGet = false;
+  // only a listing needs a data connection
+  if (!isListing())
+    dropPendingPasv();
+  startSession();
+}
+
+const FTPClient::Status &FTPClient::runCommand(uint32_t command, const String &remoteName, bool blocking, const String &renameTo)
+{
+  // let a keepalive NOOP finish first
+  while (cNoop == ftpState)
+  {
+    handleFTP();
+    delay(1);
+  }
+
+  if (ftpState < cIdle)
+  {
+    // return error code with status "in PROGRESS"
+    _serverStatus.code = errorAlreadyInProgress;
+    return _serverStatus;
+  }
+  startCommand(command, remoteName, renameTo);
+  if (blocking)
+    waitDone();
+  return _serverStatus;
+}
+
+void FTPClient::waitDone()
+{
+  // (a failed re-used connection is still in progress, it gets reconnected)
+  while (ftpState <= cQuit || (ftpState > cIdle && _sessionReused))
+  {
+    handleFTP();
+    delay(25);
+  }
+}
+
+bool FTPClient::isListing() const
+{
+  return FTP_CMD(MLSD) == _command || FTP_CMD(NLST) == _command;
+}
+
+int16_t FTPClient::commandReply(uint32_t command)
+{
+  switch (command)
+  {
+  case FTP_CMD(MKD):
+    return 257; // 257 "<dir>" created
+  case FTP_CMD(RNFR):
+    return 350; // 350 Ready for RNTO
+  case FTP_CMD(SIZE):
+  case FTP_CMD(MDTM):
+    return 213; // 213 <size> / 213 YYYYMMDDHHMMSS
+  default:
+    return 250; // 250 Requested file action okay (DELE, RNTO)
+  }
+}
+
+const FTPClient::Status &FTPClient::list(const String &remoteDir, bool namesOnly, bool blocking)
+{
+  return runCommand(namesOnly ? FTP_CMD(NLST) : FTP_CMD(MLSD), remoteDir, blocking);
+}
+
+const std::vector<FTPClient::DirEntry> &FTPClient::entries() const
+{
+  return _entries;
+}
+
+const FTPClient::Status &FTPClient::size(const String &remoteFileName, bool blocking)
+{
+  return runCommand(FTP_CMD(SIZE), remoteFileName, blocking);
+}
+
+const FTPClient::Status &FTPClient::modTime(const String &remoteFileName, bool blocking)
+{
+  return runCommand(FTP_CMD(MDTM), remoteFileName, blocking);
+}
+
+const FTPClient::Status &FTPClient::remove(const String &remoteFileName, bool blocking)
+{
+  return runCommand(FTP_CMD(DELE), remoteFileName, blocking);
+}
+
+const FTPClient::Status &FTPClient::rename(const String &fromName, const String &toName, bool blocking)
+{
+  return runCommand(FTP_CMD(RNFR), fromName, blocking, toName);
+}
+
+const FTPClient::Status &FTPClient::makeDir(const String &remoteDir, bool blocking)
+{
+  return runCommand(FTP_CMD(MKD), remoteDir, blocking);
+}
+
+uint32_t FTPClient::remoteSize() const
+{
+  return _remoteSize;
+}
+
+time_t FTPClient::remoteModTime() const
+{
+  return _remoteModTime;
+}
+
+// stay logged in if more requests are to come (or a persistent session is wanted)
+bool FTPClient::keepSession() const
+{
+  return _persistent || _queueLen > 1 || _mirrorActive;
+}
+
+void FTPClient::requestDone()
+{
+  if (keepSession())
+  {
+    _serverStatus.result = OK;
+    _idleSince = millis();
+    ftpState = cIdle;
+  }
+  else
+  {
+    ftpState = cQuit;
+  }
+}
+
 const FTPClient::Status &FTPClient::check()
 {
   return _serverStatus;
 }
 
+void FTPClient::setPersistent(bool enable, uint32_t noopIntervalMs)
+{
+  _persistent = enable;
+  _noopInterval = noopIntervalMs;
+}
+
+void FTPClient::setSegments(uint8_t segments)
+{
+  if (segments < 1)
+    segments = 1;
+  if (segments > FTP_CLIENT_MAX_SEGMENTS)
+    segments = FTP_CLIENT_MAX_SEGMENTS;
+  _segments = segments;
+}
+
+//
+// split the download of a remote file of size bytes into byte ranges: this
+// client fetches the first one, worker clients (with their own control and data
+// connection) the others, all of them write into the same (shared) local file
+//
+void FTPClient::startSegments(uint32_t size)
+{
+  uint8_t n = _segments;
+  while (n > 1 && size / n < FTP_CLIENT_SEGMENT_MIN_SIZE)
+    --n;
+  if (n < 2)
+    return;
+
+#if (defined ESP8266)
+  // give the file its final size, so ranges can be written behind the bytes received so far
+  if (!file.truncate(size))
+    return;
+#endif
+
+  // as many workers as memory allows
+  uint8_t workers = 0;
+  while (workers < n - 1)
+  {
+    _workers[workers] = new (std::nothrow) FTPClient(THEFS);
+    if (NULL == _workers[workers])
+      break;
+    ++workers;
+  }
+  if (0 == workers)
+    return;
+
+  _segmentFile = file;
+  _segmentSize = size;
+  _segmentCount = workers + 1;
+  FTP_DEBUG_MSG("Downloading %" PRINTu32 " bytes in %u segments", size, _segmentCount);
+
+  // this client: first range
+  sharedFile = true;
+  fileOffset = 0;
+  transferLimit = segmentLength(0);
+
+  for (uint8_t i = 0; i < workers; ++i)
+  {
+    FTPClient *w = _workers[i];
+    uint32_t offset = (i + 1) * segmentLength(0);
+    w->begin(*_server);
+    w->inheritSettings(*this);
+    w->file = file;
+    w->sharedFile = true;
+    w->fileOffset = offset;
+    w->transferLimit = segmentLength(i + 1);
+    w->_restartOffset = offset;
+    w->_remoteFileName = _remoteFileName;
+    w->_direction = FTP_GET_NONBLOCKING;
+    w->_serverStatus.result = PROGRESS;
+    w->ftpState = cConnect;
+  }
+}
+
+// length of byte range n, the last one takes the remainder
+uint32_t FTPClient::segmentLength(uint8_t n) const
+{
+  uint32_t len = _segmentSize / _segmentCount;
+  return (n == _segmentCount - 1) ? _segmentSize - n * len : len;
+}
+
+void FTPClient::endSegments()
+{
+  for (uint8_t i = 0; i < FTP_CLIENT_MAX_SEGMENTS - 1; ++i)
+  {
+    delete _workers[i];
+    _workers[i] = nullptr;
+  }
+  _segmentFile.close();
+  _segmentCount = 0;
+}
+
+bool FTPClient::enqueue(const String &localFileName, const String &remoteFileName, TransferType direction, TransferCallback callback)
+{
+  if (_queueLen >= FTP_CLIENT_QUEUE_SIZE)
+    return false;
+
+  Job &job = _queue[(_queueHead + _queueLen) % FTP_CLIENT_QUEUE_SIZE];
+  job.localFileName = localFileName;
+  job.remoteFileName = remoteFileName;
+  job.direction = (TransferType)(direction & 0x7f); // handleFTP() drives the transfer
+  job.command = 0;
+  job.ignoreExisting = false;
+  job.callback = callback;
+  ++_queueLen;
+  return true;
+}
+
+bool FTPClient::enqueueCommand(uint32_t command, const String &remoteName, TransferCallback callback, bool ignoreExisting)
+{
+  if (_queueLen >= FTP_CLIENT_QUEUE_SIZE)
+    return false;
+
+  Job &job = _queue[(_queueHead + _queueLen) % FTP_CLIENT_QUEUE_SIZE];
+  job.localFileName.clear();
+  job.remoteFileName = remoteName;
+  job.direction = FTP_GET_NONBLOCKING;
+  job.command = command;
+  job.ignoreExisting = ignoreExisting;
+  job.callback = callback;
+  ++_queueLen;
+  return true;
+}
+
+bool FTPClient::mirror(const String &localDir, const String &remoteDir, TransferCallback callback)
+{
+  if (_mirrorActive)
+    return false;
+
+  _mirrorLocal = localDir;
+  while (_mirrorLocal.endsWith(F("/")))
+    _mirrorLocal.remove(_mirrorLocal.length() - 1);
+  _mirrorRemote = remoteDir;
+  while (_mirrorRemote.endsWith(F("/")))
+    _mirrorRemote.remove(_mirrorRemote.length() - 1);
+  _mirrorCallback = callback;
+
+  // start with the root directory itself
+  _mirrorDirs.clear();
+  _mirrorDirs.push_back(String());
+  _mirrorActive = true;
+  return true;
+}
+
+bool FTPClient::mirroring() const
+{
+  return _mirrorActive;
+}
+
+//
+// walk the local tree one entry at a time: files are queued as synced uploads,
+// directories are remembered and walked later (after their remote counterpart
+// is created)
+//
+void FTPClient::mirrorNext()
+{
+  String name;
+  bool found = false;
+  bool isDir = false;
+#if (defined ESP8266)
+  if (_mirrorDir.next())
+  {
+    found = true;
+    name = _mirrorDir.fileName();
+    isDir = _mirrorDir.isDirectory();
+  }
+#elif (defined ESP32)
+  File f = _mirrorDir ? _mirrorDir.openNextFile() : File();
+  if (f)
+  {
+    found = true;
+    name = f.name();
+    isDir = f.isDirectory();
+    f.close();
+  }
+#endif
+  if (found)
+  {
+    // some file systems (e.g. SPIFFS) return the full path: keep the
+    // part below the directory being walked
+    String dirPath = _mirrorLocal + _mirrorPath + '/';
+    if (name.startsWith(dirPath))
+    {
+      name.remove(0, dirPath.length());
+    }
+    else
+    {
+      int16_t slash = name.lastIndexOf('/');
+      if (slash >= 0)
+        name.remove(0, slash + 1);
+    }
+    String path = _mirrorPath + '/' + name;
+    if (isDir)
+      _mirrorDirs.push_back(path);
+    else
+      enqueue(_mirrorLocal + path, _mirrorRemote + path, FTP_PUT_SYNC_NONBLOCKING, _mirrorCallback);
+    return;
+  }
+
+  // directory done, continue with the next one
+#if (defined ESP8266)
+  _mirrorDir = Dir();
+#elif (defined ESP32)
+  _mirrorDir.close();
+#endif
+  if (_mirrorDirs.empty())
+  {
+    FTP_DEBUG_MSG("Mirror: all files queued");
+    _mirrorActive = false;
+    return;
+  }
+  _mirrorPath = _mirrorDirs.back();
+  _mirrorDirs.pop_back();
+
+  String localPath = _mirrorLocal + _mirrorPath;
+  if (0 == localPath.length())
+    localPath = '/';
+#if (defined ESP8266)
+  _mirrorDir = THEFS.openDir(localPath);
+#elif (defined ESP32)
+  _mirrorDir = THEFS.open(localPath);
+#endif
+  // make sure the remote directory exists before files are put into it
+  if (_mirrorRemote.length() + _mirrorPath.length())
+    enqueueCommand(FTP_CMD(MKD), _mirrorRemote + _mirrorPath, _mirrorCallback, true);
+}
+
+uint8_t FTPClient::queued() const
+{
+  return _queueLen;
+}
+
+void FTPClient::serviceQueue()
+{
+  // running job finished?
+  if (_jobRunning && ftpState >= cIdle && PROGRESS != _serverStatus.result)
+  {
+    // take the job off the queue first, so the callback may enqueue new ones
+    Job job = _queue[_queueHead];
+    _queue[_queueHead] = Job();
+    _queueHead = (_queueHead + 1) % FTP_CLIENT_QUEUE_SIZE;
+    --_queueLen;
+    _jobRunning = false;
+    FTP_DEBUG_MSG("Job %s done, %u queued", job.remoteFileName.c_str(), _queueLen);
+    if (job.callback)
+      job.callback(job.localFileName, job.remoteFileName, _serverStatus);
+  }
+
+  // a mirror walk fills the queue as long as there is room
+  while (_mirrorActive && _queueLen < FTP_CLIENT_QUEUE_SIZE)
+    mirrorNext();
+
+  // start the next one
+  if (!_jobRunning && _queueLen && ftpState >= cIdle)
+  {
+    const Job &job = _queue[_queueHead];
+    _jobRunning = true;
+    if (job.command)
+      startCommand(job.command, job.remoteFileName, String(), job.ignoreExisting);
+    else
+      transfer(job.localFileName, job.remoteFileName, job.direction);
+  }
+}
+
 void FTPClient::handleFTP()
 {
+  // workers of a segmented download run along with us
+  for (uint8_t i = 0; i < _segmentCount - 1; ++i)
+  {
+    if (_workers[i])
+      _workers[i]->handleFTP();
+  }
+
   if (_server == nullptr)
   {
     _serverStatus.result = TransferResult::ERROR;
     _serverStatus.code = errorUninitialized;
     _serverStatus.desc = F("begin() not called");
   }
+  else if (ftpState > cIdle && _sessionReused)
+  {
+    // the re-used control connection failed before the data transfer started
+    // (e.g. closed by the server): log in again, once
+    FTP_DEBUG_MSG("Re-used connection failed, reconnecting");
+    _sessionReused = false;
+    _loggedIn = false;
+    _pasvPending = false;
+    control.stop();
+    ftpState = cConnect;
+  }
   else if (ftpState > cIdle)
   {
     _serverStatus.result = TransferResult::ERROR;
+    _loggedIn = false;
+    _pasvPending = false;
+    if (_segmentCount)
+      endSegments(); // stop the workers of a failed segmented download
   }
   else if (cConnect == ftpState)
   {
     _serverStatus.code = errorConnectionFailed;
     _serverStatus.desc = F("No connection to FTP server");
+    _loggedIn = false;
+    _replyLine.clear();
+    _multiLineCode = 0;
+    _skipReplies = 0;
     if (controlConnect())
     {
       FTP_DEBUG_MSG("Connection to %s:%u established", control.remoteIP().toString().c_str(), control.remotePort());
@@ -94,22 +604,148 @@ void FTPClient::handleFTP()
   }
   else if (cUser == ftpState)
   {
-    if (waitFor(331 /* 331 Password */))
+    if (waitFor({331 /* 331 Password */, 230 /* 230 Login successful (no password needed) */}))
     {
-      FTP_DEBUG_MSG(">>> PASS %s", _server->password.c_str());
-      control.printf_P(PSTR("PASS %s\n"), _server->password.c_str());
-      ftpState = cPassword;
+      if (230 == _serverStatus.code)
+      {
+        _loggedIn = true;
+        ftpState = cStart;
+      }
+      else
+      {
+        FTP_DEBUG_MSG(">>> PASS %s", _server->password.c_str());
+        control.printf_P(PSTR("PASS %s\n"), _server->password.c_str());
+        ftpState = cPassword;
+      }
     }
   }
   else if (cPassword == ftpState)
   {
     if (waitFor(230 /* 230 Login successful*/))
+    {
+      _loggedIn = true;
+      ftpState = cStart;
+    }
+  }
+  else if (cStart == ftpState)
+  {
+    if (isListing())
+    {
+      FTP_DEBUG_MSG(">>> PASV");
+      control.printf_P(PSTR("PASV\n"));
+      ftpState = cPassive;
+    }
+    else if (_command)
+    {
+      char name[5];
+      FTP_DEBUG_MSG(">>> %s %s", ftpCommandName(_command, name), _remoteFileName.c_str());
+      control.printf_P(PSTR("%s %s\n"), ftpCommandName(_command, name), _remoteFileName.c_str());
+      ftpState = cCommand;
+    }
+    else if (needsSize())
+    {
+      // ask for the size of the remote file: the bytes the server already has
+      // (resumed upload), to compare (synced upload) or to split (segmented download)
+      FTP_DEBUG_MSG(">>> SIZE %s", _remoteFileName.c_str());
+      control.printf_P(PSTR("SIZE %s\n"), _remoteFileName.c_str());
+      ftpState = cSize;
+    }
+    else
     {
       FTP_DEBUG_MSG(">>> PASV");
       control.printf_P(PSTR("PASV\n"));
       ftpState = cPassive;
     }
   }
+  else if (cCommand == ftpState)
+  {
+    // (the mirror's directories may exist already: 550 is fine as well)
+    bool ok = _ignoreExisting ? waitFor({commandReply(_command), 550}) : waitFor(commandReply(_command));
+    if (ok && FTP_CMD(RNFR) == _command)
+    {
+      // source accepted, now the new name
+      FTP_DEBUG_MSG(">>> RNTO %s", _renameTo.c_str());
+      control.printf_P(PSTR("RNTO %s\n"), _renameTo.c_str());
+      _command = FTP_CMD(RNTO);
+    }
+    else if (ok && (FTP_CMD(SIZE) == _command || FTP_CMD(MDTM) == _command) && NULL == replyText())
+    {
+      // "213" without a size / time
+      _serverStatus.code = errorServerResponse;
+      _serverStatus.desc = F("FTP server response not understood.");
+      ftpState = cError;
+    }
+    else if (ok)
+    {
+      if (FTP_CMD(SIZE) == _command)
+        _remoteSize = strtoul(replyText(), NULL, 10);
+      else if (FTP_CMD(MDTM) == _command)
+        _remoteModTime = parseModTime(replyText());
+      requestDone();
+    }
+  }
+  else if (cSize == ftpState)
+  {
+    bool sizeOK = waitFor(213 /* 213 <size> */);
+    // any other reply (550 no such file, 500/502 SIZE not supported, ...): size unknown,
+    // upload from the start, download without segments
+    if (sizeOK || (cError == ftpState && _serverStatus.code >= 400))
+    {
+      sizeOK = sizeOK && replyText(); // a bare "213": size unknown as well
+      uint32_t remoteSize = sizeOK ? strtoul(replyText(), NULL, 10) : 0;
+      bool sendPasv = true;
+      if ((_direction & FTP_PUT_SYNC_NONBLOCKING) == FTP_PUT_SYNC_NONBLOCKING)
+      {
+        // same size: the modification time decides
+        if (sizeOK && remoteSize == file.size())
+        {
+          FTP_DEBUG_MSG(">>> MDTM %s", _remoteFileName.c_str());
+          control.printf_P(PSTR("MDTM %s\n"), _remoteFileName.c_str());
+          ftpState = cModTime;
+          sendPasv = false;
+        }
+      }
+      else if (_direction & FTP_PUT_NONBLOCKING)
+      {
+        // continue after the remote file's bytes, start over if it's larger
+        // than the local file (or does not exist yet)
+        _restartOffset = (remoteSize > file.size()) ? 0 : remoteSize;
+        FTP_DEBUG_MSG("Resuming upload at %" PRINTu32, _restartOffset);
+      }
+      else
+      {
+        startSegments(remoteSize);
+      }
+      if (sendPasv)
+      {
+        FTP_DEBUG_MSG(">>> PASV");
+        control.printf_P(PSTR("PASV\n"));
+        ftpState = cPassive;
+      }
+    }
+  }
+  else if (cModTime == ftpState)
+  {
+    bool timeOK = waitFor(213 /* 213 YYYYMMDDHHMMSS */);
+    if (timeOK || cError == ftpState)
+    {
+      // upload unless the remote copy is at least as new as the local file
+      // (if the server can't tell, upload anyway)
+      if (timeOK && replyText() && file.getLastWrite() <= parseModTime(replyText()))
+      {
+        FTP_DEBUG_MSG("%s is up to date", _remoteFileName.c_str());
+        file.close();
+        _serverStatus.desc = F("Up to date");
+        requestDone();
+      }
+      else
+      {
+        FTP_DEBUG_MSG(">>> PASV");
+        control.printf_P(PSTR("PASV\n"));
+        ftpState = cPassive;
+      }
+    }
+  }
   else if (cPassive == ftpState)
   {
     if (waitFor(227 /* 227 Entering Passive Mode (ip,ip,ip,ip,port,port) */))
@@ -131,6 +767,12 @@ void FTPClient::handleFTP()
           }
           parseOK = true;
           ftpState = cData;
+          if (_restartOffset)
+          {
+            FTP_DEBUG_MSG(">>> REST %" PRINTu32, _restartOffset);
+            control.printf_P(PSTR("REST %" PRINTu32 "\n"), _restartOffset);
+            ftpState = cRestart;
+          }
         }
       }
       if (!parseOK)
@@ -140,6 +782,13 @@ void FTPClient::handleFTP()
       }
     }
   }
+  else if (cRestart == ftpState)
+  {
+    if (waitFor(350 /* 350 Restarting at <offset> */))
+    {
+      ftpState = cData;
+    }
+  }
   else if (cData == ftpState)
   {
     // open data connection
@@ -152,59 +801,296 @@ void FTPClient::handleFTP()
     else
     {
       FTP_DEBUG_MSG("Data connection to %s:%u established", data.remoteIP().toString().c_str(), data.remotePort());
+      _sessionReused = false; // from here on errors are not caused by a stale connection
       millisBeginTrans = millis();
       bytesTransfered = 0;
+      _transferConfirmed = false;
       ftpState = cTransfer;
-      if (allocateBuffer() == 0)
-      {
-        _serverStatus.code = errorMemory;
-        _serverStatus.desc = F("No memory for transfer buffer");
-        ftpState = cError;
-      }
-      if (_direction & FTP_PUT_NONBLOCKING)
+      if (isListing())
       {
-        FTP_DEBUG_MSG(">>> STOR %s", _remoteFileName.c_str());
-        control.printf_P(PSTR("STOR %s\n"), _remoteFileName.c_str());
+        // the listing is parsed as it arrives, no file and no transfer buffer needed
+        char name[5];
+        _entries.clear();
+        _listLine.clear();
+        // (no argument: the current directory)
+        const char *sep = _remoteFileName.length() ? " " : "";
+        FTP_DEBUG_MSG(">>> %s%s%s", ftpCommandName(_command, name), sep, _remoteFileName.c_str());
+        control.printf_P(PSTR("%s%s%s\n"), ftpCommandName(_command, name), sep, _remoteFileName.c_str());
       }
-      else if (_direction & FTP_GET_NONBLOCKING)
+      else
       {
-        FTP_DEBUG_MSG(">>> RETR %s", _remoteFileName.c_str());
-        control.printf_P(PSTR("RETR %s\n"), _remoteFileName.c_str());
+        if ((_direction & FTP_PUT_NONBLOCKING) && _restartOffset)
+        {
+          // resumed upload: send the local file from the restart offset on
+          fileOffset = _restartOffset;
+          file.seek(fileOffset);
+        }
+        // a file to PUT that's mapped to memory needs no transfer buffer
+        if (!((_direction & FTP_PUT_NONBLOCKING) && mapFile()) && allocateBuffer() == 0)
+        {
+          _serverStatus.code = errorMemory;
+          _serverStatus.desc = F("No memory for transfer buffer");
+          ftpState = cError;
+        }
+        if ((_direction & FTP_APPEND_NONBLOCKING) == FTP_APPEND_NONBLOCKING)
+        {
+          FTP_DEBUG_MSG(">>> APPE %s", _remoteFileName.c_str());
+          control.printf_P(PSTR("APPE %s\n"), _remoteFileName.c_str());
+        }
+        else if (_direction & FTP_PUT_NONBLOCKING)
+        {
+          FTP_DEBUG_MSG(">>> STOR %s", _remoteFileName.c_str());
+          control.printf_P(PSTR("STOR %s\n"), _remoteFileName.c_str());
+        }
+        else if (_direction & FTP_GET_NONBLOCKING)
+        {
+          FTP_DEBUG_MSG(">>> RETR %s", _remoteFileName.c_str());
+          control.printf_P(PSTR("RETR %s\n"), _remoteFileName.c_str());
+        }
       }
     }
   }
   else if (cTransfer == ftpState)
   {
     bool res = true;
-    if (_direction & FTP_PUT_NONBLOCKING)
+    if (isListing())
+    {
+      res = doNetworkToList();
+    }
+    else if (_direction & FTP_PUT_NONBLOCKING)
     {
-      res = doFiletoNetwork();
+      res = doFiletoNetwork() && data.connected();
     }
     else
     {
+      // false only after the staged bytes are written, even if the server closed already
       res = doNetworkToFile();
     }
-    if (!res || !data.connected())
+    if (!res)
     {
       ftpState = cFinish;
     }
+
+    // replies during the transfer: the preliminary one (150), the completion (226)
+    // which may arrive before all data is received and errors, which abort the transfer
+    int16_t code = readReply();
+    if (code >= 100 && code < 200)
+    {
+      FTP_DEBUG_MSG("Transfer: %s", _serverStatus.desc.c_str());
+    }
+    else if (226 == code || 250 == code)
+    {
+      _serverStatus.code = code;
+      _transferConfirmed = true;
+    }
+    else if (code)
+    {
+      FTP_DEBUG_MSG("Transfer failed: %s", _serverStatus.desc.c_str());
+      _serverStatus.code = code;
+      closeTransfer();
+      ftpState = cError;
+    }
   }
   else if (cFinish == ftpState)
   {
+    bool range = (transferLimit != 0);
     closeTransfer();
-    ftpState = cQuit;
+    if (_segmentCount)
+      ftpState = cJoin;
+    else if (range)
+      ftpState = cQuit; // a worker's byte range is complete
+    else
+      ftpState = cComplete;
+  }
+  else if (cComplete == ftpState)
+  {
+    // the server confirms the transfer once the data connection is closed
+    // (unless the confirmation arrived already)
+    if (_transferConfirmed || waitFor({226 /* 226 Transfer complete */, 250}))
+    {
+      // another job waiting? ask for its data port right away, the reply is
+      // read when the job starts (not for commands, resumed or synced uploads
+      // and segmented downloads, they need a SIZE first)
+      if (_jobRunning && _queueLen > 1)
+      {
+        const Job &next = _queue[(_queueHead + 1) % FTP_CLIENT_QUEUE_SIZE];
+        if (0 == next.command &&
+            (next.direction & FTP_PUT_RESUME_NONBLOCKING) != FTP_PUT_RESUME_NONBLOCKING &&
+            (next.direction & FTP_PUT_SYNC_NONBLOCKING) != FTP_PUT_SYNC_NONBLOCKING &&
+            !(_segments > 1 && FTP_GET_NONBLOCKING == next.direction))
+        {
+          FTP_DEBUG_MSG(">>> PASV");
+          control.printf_P(PSTR("PASV\n"));
+          _pasvPending = true;
+        }
+      }
+      requestDone();
+    }
+  }
+  else if (cJoin == ftpState)
+  {
+    // segmented download: wait for the workers, then check that all ranges are complete
+    bool done = true;
+    bool complete = (lastTransfer().bytes == segmentLength(0));
+    for (uint8_t i = 0; i < _segmentCount - 1; ++i)
+    {
+      FTPClient *w = _workers[i];
+      if (w->ftpState < cIdle || PROGRESS == w->_serverStatus.result)
+        done = false;
+      else
+        complete &= (OK == w->_serverStatus.result) && (w->lastTransfer().bytes == segmentLength(i + 1));
+    }
+    if (done)
+    {
+      complete &= (_segmentFile.size() == _segmentSize);
+      FTP_DEBUG_MSG("Segmented download %s", complete ? PSTR("complete") : PSTR("incomplete"));
+      endSegments();
+      // the ranges were cut off, the servers' replies to that are not awaited
+      if (complete)
+      {
+        ftpState = cQuit;
+      }
+      else
+      {
+        _serverStatus.code = errorSegments;
+        _serverStatus.desc = F("Segmented download incomplete");
+        ftpState = cError;
+      }
+    }
+  }
+  else if (cNoop == ftpState)
+  {
+    bool ok = waitFor(200 /* 200 NOOP ok */);
+    if (ok || cNoop != ftpState)
+    {
+      if (!ok)
+      {
+        // keepalive failed, the next transfer connects again
+        _loggedIn = false;
+        control.stop();
+      }
+      _serverStatus = _idleStatus;
+      _idleSince = millis();
+      ftpState = cIdle;
+    }
   }
   else if (cQuit == ftpState)
   {
     FTP_DEBUG_MSG(">>> QUIT");
     control.printf_P(PSTR("QUIT\n"));
     _serverStatus.result = OK;
+    _loggedIn = false;
     ftpState = cIdle;
   }
   else if (cIdle == ftpState)
   {
-    stop();
+    if ((!_persistent && 0 == _queueLen && !_mirrorActive) || !_loggedIn)
+    {
+      stop();
+    }
+    else if (!control.connected())
+    {
+      FTP_DEBUG_MSG("Control connection lost while idle");
+      _loggedIn = false;
+    }
+    else if (_noopInterval && (millis() - _idleSince >= _noopInterval))
+    {
+      // keep the session alive, but don't let the NOOP reply change the transfer's status
+      _idleStatus = _serverStatus;
+      FTP_DEBUG_MSG(">>> NOOP");
+      control.printf_P(PSTR("NOOP\n"));
+      ftpState = cNoop;
+    }
+  }
+
+  // the queue starts the next job as soon as the client is idle
+  serviceQueue();
+}
+
+//
+// receive a directory listing: complete lines are parsed into entries right
+// away, so only one line is held in memory. Returns false when done.
+//
+bool FTPClient::doNetworkToList()
+{
+  uint8_t buf[64];
+  int n;
+  while ((n = data.read(buf, sizeof(buf))) > 0)
+  {
+    bytesTransfered += n;
+    for (int i = 0; i < n; ++i)
+    {
+      if ('\n' == buf[i])
+        parseListLine();
+      else if ('\r' != buf[i] && _listLine.length() < FTP_REPLY_SIZE)
+        _listLine += (char)buf[i];
+    }
+  }
+  if (data.connected())
+    return true;
+
+  // last line may lack its line end
+  parseListLine();
+  return false;
+}
+
+//
+// one line of a listing:
+//   MLSD: "modify=20200517123400;size=12;type=file;UNIX.mode=0644; name" (RFC 3659)
+//   NLST: "name"
+// the current and parent directory (type=cdir / type=pdir) are skipped
+//
+void FTPClient::parseListLine()
+{
+  if (0 == _listLine.length())
+    return;
+
+  DirEntry entry = {String(), 0, false, 0};
+  if (FTP_CMD(MLSD) == _command)
+  {
+    // facts end with "; ", the name follows
+    int16_t space = _listLine.indexOf(' ');
+    if (space < 0)
+    {
+      _listLine.clear();
+      return;
+    }
+    entry.name = _listLine.c_str() + space + 1;
+    _listLine[space] = '\0';
+
+    char *fact = &_listLine[0];
+    while (fact && *fact)
+    {
+      char *next = strchr(fact, ';');
+      if (next)
+        *next++ = '\0';
+      char *value = strchr(fact, '=');
+      if (value)
+      {
+        *value++ = '\0';
+        if (0 == strcasecmp_P(fact, PSTR("type")))
+        {
+          if (0 == strcasecmp_P(value, PSTR("cdir")) || 0 == strcasecmp_P(value, PSTR("pdir")))
+          {
+            _listLine.clear();
+            return;
+          }
+          entry.isDirectory = (0 == strcasecmp_P(value, PSTR("dir")));
+        }
+        else if (0 == strcasecmp_P(fact, PSTR("size")))
+          entry.size = strtoul(value, NULL, 10);
+        else if (0 == strcasecmp_P(fact, PSTR("modify")))
+          entry.modify = parseModTime(value);
+      }
+      fact = next;
+    }
+  }
+  else
+  {
+    entry.name = _listLine;
   }
+  _listLine.clear();
+  _entries.push_back(entry);
 }
 
 int8_t FTPClient::controlConnect()
@@ -221,66 +1107,119 @@ int8_t FTPClient::controlConnect()
 }
 
 bool FTPClient::waitFor(const int16_t respCode, const __FlashStringHelper *errorString, uint32_t timeOutMs)
+{
+  return waitFor({respCode}, errorString, timeOutMs);
+}
+
+bool FTPClient::waitFor(std::initializer_list<int16_t> respCodes, const __FlashStringHelper *errorString, uint32_t timeOutMs)
 {
   // initalize waiting
   if (!aTimeout.canExpire())
-  {
     aTimeout.reset(timeOutMs);
-    _serverStatus.desc.clear();
-  }
-  else
+
+  int16_t code;
+  while ((code = readReply()) != 0)
   {
-    // timeout
-    if (aTimeout.expired())
+    _serverStatus.code = code;
+    // the server answers, so errors from here on are not caused by a stale connection
+    if (421 != code)
+      _sessionReused = false;
+
+    for (int16_t respCode : respCodes)
     {
-      aTimeout.resetToNeverExpires();
-      FTP_DEBUG_MSG("Waiting for code %u - timeout!", respCode);
-      _serverStatus.code = errorTimeout;
-      if (errorString)
-      {
-        _serverStatus.desc = errorString;
-      }
-      else
+      if (respCode == code)
       {
-        _serverStatus.desc = F("timeout");
+        FTP_DEBUG_MSG("Waiting for code %u success, FTP server replies: %s", respCode, _serverStatus.desc.c_str());
+        aTimeout.resetToNeverExpires();
+        return true;
       }
-      ftpState = cTimeout;
-      return false;
     }
-
-    // check for bytes from the client
-    while (control.available())
+    if (code >= 100 && code < 200)
     {
-      char c = control.read();
-      //FTP_DEBUG_MSG("readChar() line='%s' <= %c", _serverStatus.desc.c_str(), c);
-      if (c == '\n' || c == '\r')
-      {
-        // filter out empty lines
-        _serverStatus.desc.trim();
-        if (0 == _serverStatus.desc.length())
-          continue;
-
-        // line complete, evaluate code
-        _serverStatus.code = atoi(_serverStatus.desc.c_str());
-        if (respCode != _serverStatus.code)
-        {
-          ftpState = cError;
-          FTP_DEBUG_MSG("Waiting for code %u but SMTP server replies: %s", respCode, _serverStatus.desc.c_str());
-        }
-        else
-        {
-          FTP_DEBUG_MSG("Waiting for code %u success, SMTP server replies: %s", respCode, _serverStatus.desc.c_str());
-        }
+      // skip preliminary replies, e.g. "150 Opening data connection" before a "226"
+      FTP_DEBUG_MSG("Skipping preliminary reply: %s", _serverStatus.desc.c_str());
+      continue;
+    }
 
-        aTimeout.resetToNeverExpires();
-        return (respCode == _serverStatus.code);
-      }
-      else
-      {
-        // just add the char
-        _serverStatus.desc += c;
-      }
+    FTP_DEBUG_MSG("Waiting for code %u but FTP server replies: %s", *respCodes.begin(), _serverStatus.desc.c_str());
+    aTimeout.resetToNeverExpires();
+    ftpState = cError;
+    return false;
+  }
+
+  // timeout
+  if (aTimeout.expired())
+  {
+    aTimeout.resetToNeverExpires();
+    FTP_DEBUG_MSG("Waiting for code %u - timeout!", *respCodes.begin());
+    _serverStatus.code = errorTimeout;
+    if (errorString)
+    {
+      _serverStatus.desc = errorString;
+    }
+    else
+    {
+      _serverStatus.desc = F("timeout");
     }
+    ftpState = cTimeout;
   }
   return false;
 }
+
+const char *FTPClient::replyText() const
+{
+  // "NNN text"
+  return (_serverStatus.desc.length() > 4) ? _serverStatus.desc.c_str() + 4 : NULL;
+}
+
+int16_t FTPClient::readReply()
+{
+  // check for bytes from the server
+  while (control.available())
+  {
+    char c = control.read();
+    if (c != '\n' && c != '\r')
+    {
+      // just add the char
+      if (_replyLine.length() < FTP_REPLY_SIZE)
+        _replyLine += c;
+      continue;
+    }
+
+    // filter out empty lines
+    _replyLine.trim();
+    if (0 == _replyLine.length())
+      continue;
+
+    // line complete: "NNN text", "NNN-text" starts a multi-line reply which
+    // ends with a "NNN text" line of the same code
+    const char *l = _replyLine.c_str();
+    int16_t code = 0;
+    if (isdigit(l[0]) && isdigit(l[1]) && isdigit(l[2]))
+      code = (l[0] - '0') * 100 + (l[1] - '0') * 10 + (l[2] - '0');
+    bool continued = (code && '-' == l[3]);
+
+    if (_multiLineCode ? (code != _multiLineCode || continued) : continued)
+    {
+      FTP_DEBUG_MSG("<<< %s", l);
+      if (!_multiLineCode)
+        _multiLineCode = code;
+      _replyLine.clear();
+      continue;
+    }
+
+    _multiLineCode = 0;
+    if (_skipReplies && !(code >= 100 && code < 200))
+    {
+      FTP_DEBUG_MSG("Ignoring reply: %s", l);
+      --_skipReplies;
+      _replyLine.clear();
+      continue;
+    }
+    _serverStatus.desc = _replyLine;
+    _replyLine.clear();
+    // a line without a code is not understood
+    return code ? code : errorServerResponse;
+  }
+  return 0;
+}
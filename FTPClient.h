@@ -20,6 +20,8 @@
  **                                                                            **
  *******************************************************************************/
 #include <FS.h>
+#include <initializer_list>
+#include <vector>
 #include "FTPCommon.h"
 
 class FTPClient : public FTPCommon
@@ -52,6 +54,7 @@ public:
 	static constexpr int16_t errorUninitialized = -6;
 	static constexpr int16_t errorTimeout = -7;
 	static constexpr int16_t errorMemory = -8;
+	static constexpr int16_t errorSegments = -9;
 
 	typedef struct
 	{
@@ -64,13 +67,22 @@ public:
 	{
 		FTP_PUT = 1 | 0x80,
 		FTP_GET = 2 | 0x80,
+		FTP_APPEND = FTP_PUT | 4, // put, append to the remote file
+		FTP_PUT_RESUME = FTP_PUT | 8, // put, continue after the bytes the remote file already has
+		FTP_GET_RESUME = FTP_GET | 8, // get, continue after the bytes the local file already has
+		FTP_PUT_SYNC = FTP_PUT | 16,  // put, unless the remote file has the same size and is not older
 		FTP_PUT_NONBLOCKING = FTP_PUT & 0x7f,
 		FTP_GET_NONBLOCKING = FTP_GET & 0x7f,
+		FTP_APPEND_NONBLOCKING = FTP_APPEND & 0x7f,
+		FTP_PUT_RESUME_NONBLOCKING = FTP_PUT_RESUME & 0x7f,
+		FTP_GET_RESUME_NONBLOCKING = FTP_GET_RESUME & 0x7f,
+		FTP_PUT_SYNC_NONBLOCKING = FTP_PUT_SYNC & 0x7f,
 	} TransferType;
 
 	// contruct an instance of the FTP Client using a
 	// given FS object, e.g. SPIFFS or LittleFS
 	FTPClient(FS &_FSImplementation);
+	virtual ~FTPClient();
 
 	// initialize FTP Client with the ftp server's credentials
 	void begin(const ServerInfo &server);
@@ -81,6 +93,66 @@ public:
 	// check status
 	const Status &check();
 
+	// keep the control connection logged in after a transfer, so the next
+	// transfer only needs a new data connection. While idle, a NOOP is sent every
+	// noopIntervalMs (from handleFTP()) to keep the server from timing out. A lost
+	// connection is re-established by the next transfer.
+	void setPersistent(bool enable = true, uint32_t noopIntervalMs = FTP_CLIENT_NOOP_INTERVAL);
+
+	// segmented download: FTP_GET transfers of large files are split into up to
+	// segments byte ranges, fetched in parallel over as many sessions (REST + RETR
+	// each) and written at their offsets in the local file. The download fails
+	// (errorSegments) if not all ranges arrived completely. 1 (default) disables it.
+	void setSegments(uint8_t segments);
+
+	// transfer queue: jobs are transferred one after the other (non-blocking) by
+	// handleFTP() over one logged in session. The callback (optional) receives
+	// the final status of each job. Returns false if the queue is full.
+	typedef std::function<void(const String &localFileName, const String &remoteFileName, const Status &status)> TransferCallback;
+	bool enqueue(const String &localFileName, const String &remoteFileName, TransferType direction = FTP_GET, TransferCallback callback = nullptr);
+
+	// number of queued jobs (incl. the one being transferred)
+	uint8_t queued() const;
+
+	// mirror a local directory tree to the server: all files below localDir are
+	// queued as FTP_PUT_SYNC transfers (i.e. only changed files are uploaded) to the
+	// same path below remoteDir, remote directories are created as needed.
+	// The tree is walked while the queue drains, callback receives every job's status.
+	// Returns false if a mirror is already running.
+	bool mirror(const String &localDir, const String &remoteDir, TransferCallback callback = nullptr);
+
+	// true while a mirror still walks the local tree
+	bool mirroring() const;
+
+	// an entry of a remote directory listing, see list()
+	typedef struct
+	{
+		String name;
+		uint32_t size;    // 0 for directories or if unknown (NLST)
+		bool isDirectory; // always false for NLST
+		time_t modify;    // modification time (UTC), 0 if unknown
+	} DirEntry;
+
+	// remote file operations: blocking (default) or non-blocking via handleFTP()
+	// like transfer(), check() reports the result and the server's reply.
+	// list the remote directory (MLSD, names only: NLST) into entries()
+	const Status &list(const String &remoteDir, bool namesOnly = false, bool blocking = true);
+	const std::vector<DirEntry> &entries() const;
+	// size of a remote file, see remoteSize()
+	const Status &size(const String &remoteFileName, bool blocking = true);
+	// modification time of a remote file, see remoteModTime()
+	const Status &modTime(const String &remoteFileName, bool blocking = true);
+	// delete a remote file
+	const Status &remove(const String &remoteFileName, bool blocking = true);
+	// rename (or move) a remote file or directory
+	const Status &rename(const String &fromName, const String &toName, bool blocking = true);
+	// create a remote directory
+	const Status &makeDir(const String &remoteDir, bool blocking = true);
+
+	// results of size() and modTime()
+	uint32_t remoteSize() const;
+	time_t remoteModTime() const;
+
 	// call freqently (e.g. in loop()), when using non-blocking mode
 	void handleFTP();
 
@@ -91,10 +163,18 @@ protected:
 		cGreet,
 		cUser,
 		cPassword,
+		cStart,
+		cCommand,
+		cSize,
+		cModTime,
 		cPassive,
+		cRestart,
 		cData,
 		cTransfer,
 		cFinish,
+		cComplete,
+		cJoin,
+		cNoop,
 		cQuit,
 		cIdle,
 		cTimeout,
@@ -107,10 +187,97 @@ protected:
 
 	String _remoteFileName;
 	TransferType _direction;
+	uint32_t _restartOffset = 0; // resumed transfers: bytes already transferred before
+
+	// persistent control connection, see setPersistent()
+	bool _persistent = false;
+	uint32_t _noopInterval = FTP_CLIENT_NOOP_INTERVAL;
+	bool _loggedIn = false;      // control connection is logged in
+	bool _sessionReused = false; // current transfer started on an already logged in connection
+	uint32_t _idleSince = 0;     // millis() of the last reply while idle
+	Status _idleStatus;          // status of the last transfer, kept while sending NOOPs
+	bool _pasvPending = false;   // PASV for the next queued job already sent
+	uint8_t _skipReplies = 0;    // replies still to come for requests given up (an early PASV)
+	void dropPendingPasv();      // the next request can't use the early PASV
+	bool needsSize() const;      // the transfer starts with a SIZE (resumed or synced upload, segmented download)
+
+	// transfer queue, see enqueue()
+	typedef struct
+	{
+		String localFileName;
+		String remoteFileName;
+		TransferType direction;
+		uint32_t command; // FTP_CMD() of a command job (no transfer), 0 for transfers
+		bool ignoreExisting; // command job: a 550 reply (e.g. directory exists) is fine
+		TransferCallback callback;
+	} Job;
+	Job _queue[FTP_CLIENT_QUEUE_SIZE];
+	uint8_t _queueHead = 0;   // job being transferred (if _jobRunning)
+	uint8_t _queueLen = 0;
+	bool _jobRunning = false;
+	void serviceQueue();      // finish the running job, start the next one
+	bool enqueueCommand(uint32_t command, const String &remoteName, TransferCallback callback, bool ignoreExisting = false);
+
+	uint32_t _command = 0; // command being sent instead of a transfer (see Job)
+	String _renameTo;      // RNTO argument of a RNFR command
+	bool _ignoreExisting = false; // see Job
+	void startCommand(uint32_t command, const String &remoteName, const String &renameTo = String(), bool ignoreExisting = false);
+	const Status &runCommand(uint32_t command, const String &remoteName, bool blocking, const String &renameTo = String());
+	void waitDone();       // run handleFTP() until the request is complete (blocking mode)
+	bool isListing() const; // _command needs a data connection
+	static int16_t commandReply(uint32_t command); // reply code of a successful command
+
+	// results of list(), size() and modTime()
+	std::vector<DirEntry> _entries;
+	String _listLine;      // listing line being received
+	uint32_t _remoteSize = 0;
+	time_t _remoteModTime = 0;
+	bool doNetworkToList(); // receive the listing, entries are added line by line
+	void parseListLine();
+	void startSession();   // log in or re-use the session for the next request
+	bool keepSession() const;
+	void requestDone();    // request complete: stay logged in or quit
+
+	// mirror, see mirror()
+	bool _mirrorActive = false;
+	String _mirrorLocal;                // local root (without trailing '/')
+	String _mirrorRemote;               // remote root (without trailing '/')
+	String _mirrorPath;                 // directory being walked, relative to the roots
+	std::vector<String> _mirrorDirs;    // directories still to walk
+#if (defined ESP8266)
+	Dir _mirrorDir;
+#elif (defined ESP32)
+	File _mirrorDir;
+#endif
+	TransferCallback _mirrorCallback;
+	void mirrorNext();                  // queue the next file or directory of the tree
+
+	// segmented download, see setSegments()
+	uint8_t _segments = 1;
+	bool _segmentedGet = false;  // current transfer may be split
+	uint8_t _segmentCount = 0;   // number of ranges of the current transfer (0: not split)
+	uint32_t _segmentSize = 0;   // size of the remote file
+	File _segmentFile;           // the local file, shared with the workers until all ranges are in
+	FTPClient *_workers[FTP_CLIENT_MAX_SEGMENTS - 1] = {nullptr}; // clients fetching ranges 1..n-1
+	void startSegments(uint32_t size);
+	uint32_t segmentLength(uint8_t n) const;
+	void endSegments();
 
 	int8_t controlConnect(); // connects to ServerInfo, returns -1: no connection possible, +1: connection established
 
+	// wait (non-blocking) for a reply with one of the expected codes, preliminary (1xx)
+	// replies are skipped unless expected. Any other reply sets cError, no reply cTimeout.
+	bool waitFor(std::initializer_list<int16_t> respCodes, const __FlashStringHelper *errorString = nullptr, uint32_t timeOut = 10000);
 	bool waitFor(const int16_t respCode, const __FlashStringHelper *errorString = nullptr, uint32_t timeOut = 10000);
+
+	// read the server's replies (non-blocking): returns the code once a reply is
+	// complete (all lines of a multi-line "NNN-" reply), 0 before. The reply's
+	// (last) line goes to _serverStatus.desc
+	int16_t readReply();
+	const char *replyText() const; // text after the code of the last reply, NULL if there is none
+	String _replyLine;            // reply line being received
+	int16_t _multiLineCode = 0;   // code of the multi-line reply being received
+	bool _transferConfirmed = false; // completion reply (226) already received during the transfer
 };
 
 #endif // FTP_CLIENT_H
@@ -1,5 +1,87 @@
 #include "FTPCommon.h"
 
+char *ftpCommandName(uint32_t code, char *buf)
+{
+    char *p = buf;
+    for (int8_t shift = 24; shift >= 0 && (code >> shift) & 0xff; shift -= 8)
+        *p++ = (code >> shift) & 0xff;
+    *p = '\0';
+    return buf;
+}
+
+uint8_t *FTPBufferPool::memory = NULL;
+uint32_t FTPBufferPool::usedMask = 0;
+FTPBufferPool::Stats FTPBufferPool::poolStats = {};
+
+bool FTPBufferPool::begin(uint8_t slabs, uint16_t slabSize)
+{
+    if (!end())
+        return false;
+
+    if (slabs > 32)
+        slabs = 32;
+    // MSS aligned slabs
+    slabSize = ((slabSize + BUFFERSIZE - 1) / BUFFERSIZE) * BUFFERSIZE;
+
+    memory = (uint8_t *)malloc((uint32_t)slabs * slabSize);
+    if (NULL == memory)
+    {
+        FTP_DEBUG_MSG("Cannot allocate buffer pool of %u x %u bytes", slabs, slabSize);
+        return false;
+    }
+    poolStats.slabs = slabs;
+    poolStats.slabSize = slabSize;
+    return true;
+}
+
+bool FTPBufferPool::end()
+{
+    if (usedMask)
+        return false;
+
+    free(memory);
+    memory = NULL;
+    poolStats = {};
+    return true;
+}
+
+uint8_t *FTPBufferPool::acquire(uint16_t &size)
+{
+    for (uint8_t i = 0; i < poolStats.slabs; ++i)
+    {
+        if (0 == (usedMask & (1UL << i)))
+        {
+            usedMask |= (1UL << i);
+            ++poolStats.acquired;
+            if (++poolStats.inUse > poolStats.highWater)
+                poolStats.highWater = poolStats.inUse;
+            size = poolStats.slabSize;
+            return memory + (uint32_t)i * poolStats.slabSize;
+        }
+    }
+    ++poolStats.misses;
+    return NULL;
+}
+
+bool FTPBufferPool::release(uint8_t *buffer)
+{
+    if (NULL == memory || buffer < memory || buffer >= memory + (uint32_t)poolStats.slabs * poolStats.slabSize)
+        return false;
+
+    uint8_t i = (buffer - memory) / poolStats.slabSize;
+    if (usedMask & (1UL << i))
+    {
+        usedMask &= ~(1UL << i);
+        --poolStats.inUse;
+    }
+    return true;
+}
+
+const FTPBufferPool::Stats &FTPBufferPool::stats()
+{
+    return poolStats;
+}
+
 FTPCommon::FTPCommon(FS &_FSImplementation) : THEFS(_FSImplementation), sTimeOutMs(FTP_TIME_OUT * 60 * 1000), aTimeout(FTP_TIME_OUT * 60 * 1000)
 {
 }
@@ -13,8 +95,19 @@ void FTPCommon::stop()
 {
     control.stop();
     data.stop();
-    file.close();
+    releaseFile();
     freeBuffer();
+    fileOffset = 0;
+    transferLimit = 0;
+}
+
+void FTPCommon::releaseFile()
+{
+    if (sharedFile)
+        file = File(); // just drop our reference, the owner closes it
+    else
+        file.close();
+    sharedFile = false;
 }
 
 void FTPCommon::setTimeout(uint32_t timeoutMs)
@@ -22,25 +115,75 @@ void FTPCommon::setTimeout(uint32_t timeoutMs)
     sTimeOutMs = timeoutMs;
 }
 
+void FTPCommon::setSendBudget(uint32_t maxBytes, uint16_t maxMs)
+{
+    sendBudgetBytes = maxBytes;
+    sendBudgetMs = maxMs;
+}
+
+void FTPCommon::setMapFileFunction(MapFileFunction function)
+{
+    mapFileFunction = function;
+}
+
+void FTPCommon::setAdaptiveBuffer(bool enable)
+{
+    adaptiveBuffer = enable;
+}
+
+const FTPCommon::TransferStats &FTPCommon::lastTransfer() const
+{
+    return transferStats;
+}
+
+void FTPCommon::inheritSettings(const FTPCommon &from)
+{
+    sTimeOutMs = from.sTimeOutMs;
+    sendBudgetBytes = from.sendBudgetBytes;
+    sendBudgetMs = from.sendBudgetMs;
+    mapFileFunction = from.mapFileFunction;
+    adaptiveBuffer = from.adaptiveBuffer;
+}
+
 //
 // allocate a big buffer for file transfers
 //
 uint16_t FTPCommon::allocateBuffer(uint16_t desiredBytes)
 {
+    // start with empty buffers
+    chunkLen[0] = chunkLen[1] = 0;
+    chunkPos = 0;
+    activeChunk = 0;
+    stagedBytes = 0;
+    drainedFast = 0;
+    bufferResizes = 0;
+
+    if (fileBuffer)
+        return fileBufferSize;
+
+    // take a slab from the pool (if set up)
+    fileBuffer = FTPBufferPool::acquire(fileBufferSize);
+    pooledBuffer = (fileBuffer != NULL);
+    if (pooledBuffer)
+        return fileBufferSize;
+
 #if (defined ESP8266)
     uint16_t maxBlock = ESP.getMaxFreeBlockSize() / 2;
 
     if (desiredBytes > maxBlock)
         desiredBytes = maxBlock;
 #endif
-    while (fileBuffer == NULL && desiredBytes > 0)
+    if (desiredBytes < FTP_BUFFER_MIN_SIZE)
+        desiredBytes = FTP_BUFFER_MIN_SIZE;
+
+    while (fileBuffer == NULL && desiredBytes >= FTP_BUFFER_MIN_SIZE)
     {
         fileBuffer = (uint8_t *)malloc(desiredBytes);
         if (NULL == fileBuffer)
         {
-            FTP_DEBUG_MSG("Cannot allocate buffer for file transfer, re-trying");
-            // try with less bytes
-            desiredBytes--;
+            FTP_DEBUG_MSG("Cannot allocate %u bytes buffer for file transfer, re-trying", desiredBytes);
+            // try with half the bytes
+            desiredBytes /= 2;
         }
         else
         {
@@ -50,10 +193,95 @@ uint16_t FTPCommon::allocateBuffer(uint16_t desiredBytes)
     return fileBufferSize;
 }
 
+//
+// grow or shrink the transfer buffer (adaptive mode only)
+// must only be called when chunk 1 is empty, i.e. no bytes have been read ahead
+//
+void FTPCommon::adaptBuffer()
+{
+    // pool slabs have a fixed size
+    if (!adaptiveBuffer || NULL == fileBuffer || pooledBuffer)
+        return;
+
+    uint16_t desiredBytes = fileBufferSize;
+    if (ESP.getFreeHeap() < FTP_BUFFER_HEAP_RESERVE)
+    {
+        // heap pressure: shrink
+        desiredBytes = fileBufferSize / 2;
+        if (desiredBytes < FTP_BUFFER_MIN_SIZE)
+            desiredBytes = FTP_BUFFER_MIN_SIZE;
+    }
+    else if (drainedFast >= 4)
+    {
+        // socket keeps up: grow
+        desiredBytes = (fileBufferSize > FTP_BUFFER_MAX_SIZE / 2) ? FTP_BUFFER_MAX_SIZE : 2 * fileBufferSize;
+#if (defined ESP8266)
+        // but don't take the last big block
+        if ((uint32_t)(desiredBytes - fileBufferSize) > ESP.getMaxFreeBlockSize() / 2)
+            desiredBytes = fileBufferSize;
+#endif
+    }
+
+    if (desiredBytes != fileBufferSize && resizeBuffer(desiredBytes))
+    {
+        drainedFast = 0;
+        ++bufferResizes;
+    }
+}
+
+bool FTPCommon::resizeBuffer(uint16_t desiredBytes)
+{
+    // the unsent bytes of the active chunk become chunk 0 of the resized buffer
+    uint16_t pending = chunkLen[activeChunk] - chunkPos;
+    if (chunkLen[activeChunk ^ 1] > 0 || pending > desiredBytes / 2 || stagedBytes > 0)
+        return false;
+
+    memmove(fileBuffer, chunkBuffer(activeChunk) + chunkPos, pending);
+    chunkLen[0] = pending;
+    chunkLen[1] = 0;
+    chunkPos = 0;
+    activeChunk = 0;
+
+    uint8_t *p = (uint8_t *)realloc(fileBuffer, desiredBytes);
+    if (NULL == p)
+        return false;
+
+    FTP_DEBUG_MSG("Transfer buffer resized %u -> %u bytes", fileBufferSize, desiredBytes);
+    fileBuffer = p;
+    fileBufferSize = desiredBytes;
+    return true;
+}
+
 void FTPCommon::freeBuffer()
 {
-    free(fileBuffer);
+    if (!pooledBuffer || !FTPBufferPool::release(fileBuffer))
+        free(fileBuffer);
     fileBuffer = NULL;
+    pooledBuffer = false;
+    fileBufferSize = 0;
+    stagedBytes = 0; // staged bytes are gone with the buffer
+    // a mapped file replaces the buffer as well
+    mappedFile = NULL;
+}
+
+//
+// check, if the file's contents can be sent directly from memory
+//
+bool FTPCommon::mapFile()
+{
+    mappedFile = NULL;
+    if (mapFileFunction && file)
+    {
+        uint32_t length = 0;
+        const uint8_t *p = mapFileFunction(file, length);
+        // only use the mapping if it covers the whole file
+        if (p && length >= file.size())
+        {
+            mappedFile = p;
+            FTP_DEBUG_MSG("File mapped to memory, %" PRINTu32 " bytes", length);
+        }
+    }
+    return (mappedFile != NULL);
 }
 
 int8_t FTPCommon::dataConnect()
@@ -92,26 +320,112 @@ bool FTPCommon::parseDataIpPort(const char *p)
 bool FTPCommon::doFiletoNetwork()
 {
     // data connection lost or no more bytes to transfer?
-    if (!data.connected() || (bytesTransfered >= file.size()))
+    if (!data.connected() || (fileOffset + bytesTransfered >= file.size()))
     {
         return false;
     }
 
-    // how many bytes to transfer left?
-    uint32_t nb = (file.size() - bytesTransfered);
-    if (nb > fileBufferSize)
-        nb = fileBufferSize;
+    uint32_t millisBegin = millis();
+    uint32_t sent = 0;
 
-    // transfer the file
-    FTP_DEBUG_MSG("Transfer %d bytes fs->net", nb);
-    nb = file.readBytes((char *)fileBuffer, nb);
-    if (nb > 0)
+    if (mappedFile)
     {
-        data.write(fileBuffer, nb);
-        bytesTransfered += nb;
+        // zero copy: send directly from memory
+        do
+        {
+            size_t nb = file.size() - fileOffset - bytesTransfered;
+            size_t space = dataWriteSpace();
+            if (nb > space)
+                nb = space;
+            if (nb == 0)
+                break;
+            FTP_DEBUG_MSG("Transfer %d bytes mem->net", nb);
+            nb = data.write(mappedFile + fileOffset + bytesTransfered, nb);
+            if (nb == 0)
+                break;
+            bytesTransfered += nb;
+            sent += nb;
+        } while ((sent < sendBudgetBytes) &&
+                 (fileOffset + bytesTransfered < file.size()) &&
+                 (millis() - millisBegin < sendBudgetMs));
+
+        return true;
     }
 
-    return (nb > 0);
+    bool adapted = false;
+    do
+    {
+        // read ahead the next chunk from the file while the socket still drains the active one
+        uint8_t nextChunk = activeChunk ^ 1;
+        if (chunkLen[nextChunk] == 0 && !adapted)
+        {
+            // nothing read ahead: the buffer may be resized now (once per call)
+            adaptBuffer();
+            adapted = true;
+            nextChunk = activeChunk ^ 1;
+        }
+        if (chunkLen[nextChunk] == 0 && file.available())
+        {
+            chunkLen[nextChunk] = file.readBytes((char *)chunkBuffer(nextChunk), fileBufferSize / 2);
+            FTP_DEBUG_MSG("Read %d bytes from fs", chunkLen[nextChunk]);
+        }
+
+        // active chunk completely sent? continue with the next one
+        // (right away, switching chunks is not limited by the budget)
+        if (chunkPos >= chunkLen[activeChunk])
+        {
+            chunkLen[activeChunk] = 0;
+            chunkPos = 0;
+            activeChunk = nextChunk;
+            if (chunkLen[activeChunk] == 0)
+            {
+                // nothing left to read although not all bytes are sent
+                FTP_DEBUG_MSG("Read error, %" PRINTu32 " of %" PRINTu32 " bytes sent", fileOffset + bytesTransfered, (uint32_t)file.size());
+                return false;
+            }
+        }
+
+        // send as much of the active chunk as the socket accepts without blocking
+        size_t nb = chunkLen[activeChunk] - chunkPos;
+        size_t space = dataWriteSpace();
+        if (nb > space)
+            nb = space;
+        if (nb == 0)
+            break;
+        FTP_DEBUG_MSG("Transfer %d bytes fs->net", nb);
+        nb = data.write(chunkBuffer(activeChunk) + chunkPos, nb);
+        if (nb == 0)
+            break;
+        chunkPos += nb;
+        bytesTransfered += nb;
+        sent += nb;
+        // budget 0: one chunk per call
+    } while ((sent < sendBudgetBytes || (0 == sendBudgetBytes && chunkPos < chunkLen[activeChunk])) &&
+             (fileOffset + bytesTransfered < file.size()) &&
+             (millis() - millisBegin < sendBudgetMs));
+
+#if (defined ESP8266)
+    // the socket kept up, if it could still take a whole chunk
+    if (dataWriteSpace() >= fileBufferSize / 2)
+        ++drainedFast;
+    else
+        drainedFast = 0;
+#else
+    // the send window can't be queried (see dataWriteSpace()), sending doesn't grow the buffer
+#endif
+
+    // inidcate, we need to be called again
+    return true;
+}
+
+size_t FTPCommon::dataWriteSpace()
+{
+#if (defined ESP8266)
+    return data.availableForWrite();
+#else
+    // no way to query the send window, rely on the byte and time budget
+    return BUFFERSIZE;
+#endif
 }
 
 bool FTPCommon::doNetworkToFile()
@@ -121,17 +435,50 @@ bool FTPCommon::doNetworkToFile()
 
     if (navail > 0)
     {
-        if (navail > fileBufferSize)
-            navail = fileBufferSize;
+        // stage the bytes in fileBuffer, so the file gets written in full buffers
+        if (navail > fileBufferSize - stagedBytes)
+        {
+            // socket has more bytes than fit into the buffer
+            navail = fileBufferSize - stagedBytes;
+            ++drainedFast;
+        }
+        else
+        {
+            // the buffer keeps up with the socket
+            drainedFast = 0;
+        }
+        if (transferLimit && (uint32_t)navail > transferLimit - bytesTransfered)
+        {
+            // don't read beyond the end of the byte range
+            navail = transferLimit - bytesTransfered;
+        }
         FTP_DEBUG_MSG("Transfer %d bytes net->FS", navail);
-        navail = data.read(fileBuffer, navail);
-        file.write(fileBuffer, navail);
-        bytesTransfered += navail;
+        navail = data.read(fileBuffer + stagedBytes, navail);
+        if (navail > 0)
+        {
+            stagedBytes += navail;
+            bytesTransfered += navail;
+        }
+        if (stagedBytes >= fileBufferSize)
+        {
+            if (!flushStaged())
+                return false;
+            // empty buffer: it may be resized now
+            adaptBuffer();
+        }
+    }
+
+    if (transferLimit && bytesTransfered >= transferLimit)
+    {
+        // byte range complete
+        flushStaged();
+        return false;
     }
 
     if (!data.connected() && (navail <= 0))
     {
         // connection closed or no more bytes to read
+        flushStaged();
         return false;
     }
     else
@@ -141,9 +488,38 @@ bool FTPCommon::doNetworkToFile()
     }
 }
 
+bool FTPCommon::flushStaged()
+{
+    if (stagedBytes == 0 || NULL == fileBuffer)
+        return true;
+
+    // others may have moved the position of a shared file
+    if (sharedFile && !file.seek(fileOffset + bytesTransfered - stagedBytes))
+    {
+        stagedBytes = 0;
+        return false;
+    }
+
+    size_t nb = file.write(fileBuffer, stagedBytes);
+    FTP_DEBUG_MSG("Wrote %d of %d bytes to fs", nb, stagedBytes);
+    bool ok = (nb == stagedBytes);
+    stagedBytes = 0;
+    return ok;
+}
+
 void FTPCommon::closeTransfer()
 {
+    // net->fs: write what's still staged
+    flushStaged();
+
+    transferStats.bytes = bytesTransfered;
+    transferStats.millis = millis() - millisBeginTrans;
+    transferStats.bufferSize = fileBufferSize;
+    transferStats.resizes = bufferResizes;
+
     data.stop();
-    file.close();
+    releaseFile();
     freeBuffer();
+    fileOffset = 0;
+    transferLimit = 0;
 }
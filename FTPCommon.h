@@ -2,6 +2,7 @@
 #define FTP_COMMON_H
 
 #include <stdint.h>
+#include <functional>
 #include <FS.h>
 #include <WiFiClient.h>
 #include <WString.h>
@@ -21,9 +22,51 @@ using esp32Pool::polledTimeout::oneShotMs;
 #define FTP_SERVER_VERSION "0.9.7-20200529"
 
 #define FTP_CTRL_PORT 21         // Command port on which server is listening
-#define FTP_DATA_PORT_PASV 50009 // Data port in passive mode
+#ifndef FTP_MAX_SESSIONS
+#define FTP_MAX_SESSIONS 4       // max. number of concurrent client sessions of the server
+#endif
+#define FTP_DATA_PORT_PASV 50009 // (first) Data port in passive mode
+#ifndef FTP_PASV_PORT_COUNT
+#define FTP_PASV_PORT_COUNT 16   // number of data ports in passive mode, starting at FTP_DATA_PORT_PASV
+#endif
+#ifndef FTP_PASV_LISTENERS
+#define FTP_PASV_LISTENERS FTP_MAX_SESSIONS // max. number of passive data ports listening at the same time
+#endif
 #define FTP_TIME_OUT 5           // Disconnect client after 5 minutes of inactivity
 #define FTP_CMD_SIZE 127         // allow max. 127 chars in a received command
+#ifndef FTP_REPLY_SIZE
+#define FTP_REPLY_SIZE 256       // max. length of a reply line sent by the server (incl. code and CRLF)
+#endif
+#ifndef FTP_CLIENT_NOOP_INTERVAL
+#define FTP_CLIENT_NOOP_INTERVAL 60000 // ms between NOOPs a client sends on an idle persistent connection
+#endif
+#ifndef FTP_CLIENT_QUEUE_SIZE
+#define FTP_CLIENT_QUEUE_SIZE 8 // max. number of transfers queued by a client, see FTPClient::enqueue()
+#endif
+#ifndef FTP_CLIENT_MAX_SEGMENTS
+#define FTP_CLIENT_MAX_SEGMENTS 4 // max. number of parallel sessions of a segmented download
+#endif
+#ifndef FTP_CLIENT_SEGMENT_MIN_SIZE
+#define FTP_CLIENT_SEGMENT_MIN_SIZE (32 * 1024) // smaller downloads use less segments
+#endif
+#ifndef FTP_LIST_BATCH
+#define FTP_LIST_BATCH 8         // max. number of directory entries listed by one handleFTP() call
+#endif
+#ifndef FTP_BUFFER_MIN_SIZE
+#define FTP_BUFFER_MIN_SIZE 256  // transfer buffer is never smaller than this
+#endif
+#ifndef FTP_BUFFER_MAX_SIZE
+#define FTP_BUFFER_MAX_SIZE (4 * BUFFERSIZE) // adaptive transfer buffer grows up to this size
+#endif
+#ifndef FTP_BUFFER_HEAP_RESERVE
+#define FTP_BUFFER_HEAP_RESERVE 8192 // adaptive transfer buffer shrinks when less heap is free
+#endif
+#ifndef FTP_SEND_BUDGET_BYTES
+#define FTP_SEND_BUDGET_BYTES (8 * BUFFERSIZE) // max. bytes sent by one handleFTP() call, 0: one chunk per call
+#endif
+#ifndef FTP_SEND_BUDGET_MS
+#define FTP_SEND_BUDGET_MS 20    // max. time (ms) spent sending by one handleFTP() call
+#endif
 
 // Use ESP8266 Core Debug functionality
 #ifdef DEBUG_ESP_PORT
@@ -37,63 +80,56 @@ using esp32Pool::polledTimeout::oneShotMs;
 #define FTP_DEBUG_MSG(...)
 #endif
 
-#define FTP_CMD(CMD) (FTP_CMD_LE_##CMD) // make command
-#define FTP_CMD_LE_USER 0x52455355      // "USER" as uint32_t (little endian)
-#define FTP_CMD_BE_USER 0x55534552      // "USER" as uint32_t (big endian)
-#define FTP_CMD_LE_PASS 0x53534150      // "PASS" as uint32_t (little endian)
-#define FTP_CMD_BE_PASS 0x50415353      // "PASS" as uint32_t (big endian)
-#define FTP_CMD_LE_QUIT 0x54495551      // "QUIT" as uint32_t (little endian)
-#define FTP_CMD_BE_QUIT 0x51554954      // "QUIT" as uint32_t (big endian)
-#define FTP_CMD_LE_CDUP 0x50554443      // "CDUP" as uint32_t (little endian)
-#define FTP_CMD_BE_CDUP 0x43445550      // "CDUP" as uint32_t (big endian)
-#define FTP_CMD_LE_CWD 0x00445743       // "CWD"  as uint32_t (little endian)
-#define FTP_CMD_BE_CWD 0x43574400       // "CWD"  as uint32_t (big endian)
-#define FTP_CMD_LE_PWD 0x00445750       // "PWD"  as uint32_t (little endian)
-#define FTP_CMD_BE_PWD 0x50574400       // "PWD"  as uint32_t (big endian)
-#define FTP_CMD_LE_MODE 0x45444f4d      // "MODE" as uint32_t (little endian)
-#define FTP_CMD_BE_MODE 0x4d4f4445      // "MODE" as uint32_t (big endian)
-#define FTP_CMD_LE_PASV 0x56534150      // "PASV" as uint32_t (little endian)
-#define FTP_CMD_BE_PASV 0x50415356      // "PASV" as uint32_t (big endian)
-#define FTP_CMD_LE_PORT 0x54524f50      // "PORT" as uint32_t (little endian)
-#define FTP_CMD_BE_PORT 0x504f5254      // "PORT" as uint32_t (big endian)
-#define FTP_CMD_LE_STRU 0x55525453      // "STRU" as uint32_t (little endian)
-#define FTP_CMD_BE_STRU 0x53545255      // "STRU" as uint32_t (big endian)
-#define FTP_CMD_LE_TYPE 0x45505954      // "TYPE" as uint32_t (little endian)
-#define FTP_CMD_BE_TYPE 0x54595045      // "TYPE" as uint32_t (big endian)
-#define FTP_CMD_LE_ABOR 0x524f4241      // "ABOR" as uint32_t (little endian)
-#define FTP_CMD_BE_ABOR 0x41424f52      // "ABOR" as uint32_t (big endian)
-#define FTP_CMD_LE_DELE 0x454c4544      // "DELE" as uint32_t (little endian)
-#define FTP_CMD_BE_DELE 0x44454c45      // "DELE" as uint32_t (big endian)
-#define FTP_CMD_LE_LIST 0x5453494c      // "LIST" as uint32_t (little endian)
-#define FTP_CMD_BE_LIST 0x4c495354      // "LIST" as uint32_t (big endian)
-#define FTP_CMD_LE_MLSD 0x44534c4d      // "MLSD" as uint32_t (little endian)
-#define FTP_CMD_BE_MLSD 0x4d4c5344      // "MLSD" as uint32_t (big endian)
-#define FTP_CMD_LE_NLST 0x54534c4e      // "NLST" as uint32_t (little endian)
-#define FTP_CMD_BE_NLST 0x4e4c5354      // "NLST" as uint32_t (big endian)
-#define FTP_CMD_LE_NOOP 0x504f4f4e      // "NOOP" as uint32_t (little endian)
-#define FTP_CMD_BE_NOOP 0x4e4f4f50      // "NOOP" as uint32_t (big endian)
-#define FTP_CMD_LE_RETR 0x52544552      // "RETR" as uint32_t (little endian)
-#define FTP_CMD_BE_RETR 0x52455452      // "RETR" as uint32_t (big endian)
-#define FTP_CMD_LE_STOR 0x524f5453      // "STOR" as uint32_t (little endian)
-#define FTP_CMD_BE_STOR 0x53544f52      // "STOR" as uint32_t (big endian)
-#define FTP_CMD_LE_MKD 0x00444b4d       // "MKD"  as uint32_t (little endian)
-#define FTP_CMD_BE_MKD 0x4d4b4400       // "MKD"  as uint32_t (big endian)
-#define FTP_CMD_LE_RMD 0x00444d52       // "RMD"  as uint32_t (little endian)
-#define FTP_CMD_BE_RMD 0x524d4400       // "RMD" as uint32_t (big endian)
-#define FTP_CMD_LE_RNFR 0x52464e52      // "RNFR" as uint32_t (little endian)
-#define FTP_CMD_BE_RNFR 0x524e4652      // "RNFR" as uint32_t (big endian)
-#define FTP_CMD_LE_RNTO 0x4f544e52      // "RNTO" as uint32_t (little endian)
-#define FTP_CMD_BE_RNTO 0x524e544f      // "RNTO" as uint32_t (big endian)
-#define FTP_CMD_LE_FEAT 0x54414546      // "FEAT" as uint32_t (little endian)
-#define FTP_CMD_BE_FEAT 0x46454154      // "FEAT" as uint32_t (big endian)
-#define FTP_CMD_LE_MDTM 0x4d54444d      // "MDTM" as uint32_t (little endian)
-#define FTP_CMD_BE_MDTM 0x4d44544d      // "MDTM" as uint32_t (big endian)
-#define FTP_CMD_LE_SIZE 0x455a4953      // "SIZE" as uint32_t (little endian)
-#define FTP_CMD_BE_SIZE 0x53495a45      // "SIZE" as uint32_t (big endian)
-#define FTP_CMD_LE_SITE 0x45544953      // "SITE" as uint32_t (little endian)
-#define FTP_CMD_BE_SITE 0x53495445      // "SITE" as uint32_t (big endian)
-#define FTP_CMD_LE_SYST 0x54535953      // "SYST" as uint32_t (little endian)
-#define FTP_CMD_BE_SYST 0x53595354      // "SYST" as uint32_t (big endian)
+// numeric command code: the (up to 4) chars of a command packed into an uint32_t,
+// first char in the most significant byte, unused bytes 0, e.g. "CWD" -> 0x43574400
+// Independent of the cpu's endianness and alignment, never reads past the terminating 0.
+// As chars are packed in order, codes compare like the command strings.
+constexpr uint32_t ftpCommandCode(const char *cmd, uint8_t i = 0)
+{
+    return (i >= 4 || cmd[i] == '\0') ? 0 : (((uint32_t)(uint8_t)cmd[i] << (8 * (3 - i))) | ftpCommandCode(cmd, i + 1));
+}
+#define FTP_CMD(CMD) (ftpCommandCode(#CMD)) // make command code at compile time, e.g. FTP_CMD(USER)
+static_assert(FTP_CMD(CWD) == 0x43574400 && FTP_CMD(USER) == 0x55534552, "ftpCommandCode() packs chars MSB first");
+
+// textual command of a command code (the reverse of ftpCommandCode()), buf needs 5 bytes
+char *ftpCommandName(uint32_t code, char *buf);
+
+// pool of pre-allocated transfer buffers (slabs) shared by all FTP Server
+// sessions and FTP Client instances. Once begin() reserved the pool, transfers
+// take their buffer from the pool and don't touch the heap. If the pool is
+// exhausted (or not set up), transfer buffers are allocated from the heap.
+class FTPBufferPool
+{
+public:
+    // reserve slabs buffers of slabSize bytes each (rounded up to a multiple of
+    // BUFFERSIZE, i.e. one TCP MSS), at most 32 slabs
+    static bool begin(uint8_t slabs, uint16_t slabSize = 2 * BUFFERSIZE);
+
+    // release the pool's memory, fails if slabs are still in use
+    static bool end();
+
+    // take a slab from the pool, returns NULL if none is available, size receives the slab size
+    static uint8_t *acquire(uint16_t &size);
+
+    // return a slab to the pool, returns false if buffer is not part of the pool
+    static bool release(uint8_t *buffer);
+
+    typedef struct
+    {
+        uint8_t slabs;     // number of slabs in the pool
+        uint16_t slabSize; // size of each slab
+        uint8_t inUse;     // slabs currently in use
+        uint8_t highWater; // max. slabs in use at the same time
+        uint32_t acquired; // number of buffers taken from the pool
+        uint32_t misses;   // number of requests which found no free slab
+    } Stats;
+    static const Stats &stats();
+
+private:
+    static uint8_t *memory;
+    static uint32_t usedMask; // bit n set: slab n in use
+    static Stats poolStats;
+};
 
 class FTPCommon
 {
@@ -109,6 +145,34 @@ public:
     // set disconnect timeout in millisecords
     void setTimeout(uint32_t timeoutMs = FTP_TIME_OUT * 60 * 1000);
 
+    // limit the work of one handleFTP() call when sending a file:
+    // chunks are sent until the socket's send window is full, maxBytes are sent
+    // or maxMs have elapsed. maxBytes = 0 sends one chunk (half the transfer buffer) per call only.
+    void setSendBudget(uint32_t maxBytes = FTP_SEND_BUDGET_BYTES, uint16_t maxMs = FTP_SEND_BUDGET_MS);
+
+    // adaptive transfer buffer: during a transfer the buffer grows (up to
+    // FTP_BUFFER_MAX_SIZE) as long as the socket keeps up with it and shrinks
+    // (down to FTP_BUFFER_MIN_SIZE) when free heap drops below FTP_BUFFER_HEAP_RESERVE
+    void setAdaptiveBuffer(bool enable = true);
+
+    // statistics of the last completed transfer
+    typedef struct
+    {
+        uint32_t bytes;      // bytes transferred
+        uint32_t millis;     // duration of the transfer
+        uint16_t bufferSize; // size of the transfer buffer at the end (0 for zero copy transfers)
+        uint16_t resizes;    // number of times the adaptive buffer changed its size
+    } TransferStats;
+    const TransferStats &lastTransfer() const;
+
+    // optional file system capability: if the contents of an opened file are
+    // available as one contiguous, byte addressable memory range (e.g. a file of a
+    // RAM backed FS), the function returns a pointer to it and sets length,
+    // otherwise it returns NULL. Mapped files are sent without copying them
+    // through the transfer buffer.
+    typedef std::function<const uint8_t *(File &file, uint32_t &length)> MapFileFunction;
+    void setMapFileFunction(MapFileFunction function);
+
     // needs to be called frequently (e.g. in loop() )
     // to process ftp requests
     virtual void handleFTP() = 0;
@@ -129,17 +193,50 @@ protected:
     uint32_t sTimeOutMs; // disconnect timeout
     oneShotMs aTimeout;  // timeout from esp8266 core library
 
+    void inheritSettings(const FTPCommon &from); // take over timeout, budgets, ... from another instance
+
+    bool mapFile(); // probe if file can be sent directly from memory, see setMapFileFunction()
     bool doFiletoNetwork();
+    size_t dataWriteSpace(); // number of bytes data.write() accepts without blocking
+    bool flushStaged();      // write the bytes staged by doNetworkToFile() to the file
+    void releaseFile();      // close the file (or drop the reference to a shared file)
     bool doNetworkToFile();
     virtual void closeTransfer();
 
-    uint16_t allocateBuffer(uint16_t desiredBytes = BUFFERSIZE); // allocate buffer for transfer
+    uint16_t allocateBuffer(uint16_t desiredBytes = 2 * BUFFERSIZE); // allocate buffer for transfer
     void freeBuffer();
-    uint8_t *fileBuffer = NULL; // pointer to buffer for file transfer (by allocateBuffer)
-    uint16_t fileBufferSize;    // size of buffer
+    uint8_t *fileBuffer = NULL;  // pointer to buffer for file transfer (by allocateBuffer)
+    uint16_t fileBufferSize = 0; // size of buffer
+
+    // adaptive buffer, see setAdaptiveBuffer()
+    void adaptBuffer();                       // grow/shrink the buffer if needed, only when chunk 1 is empty
+    bool resizeBuffer(uint16_t desiredBytes); // resize the buffer, keep the unsent bytes of the active chunk
+    bool adaptiveBuffer = true;
+    bool pooledBuffer = false; // fileBuffer is a slab of FTPBufferPool (fixed size)
+    uint8_t drainedFast; // number of consecutive handleFTP() calls the socket kept up with the buffer
+    uint16_t bufferResizes;
+    TransferStats transferStats = {};
+
+    // fs->net: fileBuffer is split into two halves (chunks), one is read ahead
+    // from the file while the other one is still being sent
+    uint8_t *chunkBuffer(uint8_t n) { return fileBuffer + n * (fileBufferSize / 2); }
+    uint16_t chunkLen[2];    // bytes held by each chunk
+    uint16_t chunkPos;       // bytes of the active chunk already sent
+    uint8_t activeChunk;     // chunk being sent
+    // net->fs: received bytes are staged in fileBuffer and written to the file when it is full
+    uint16_t stagedBytes = 0;
+
+    uint32_t sendBudgetBytes = FTP_SEND_BUDGET_BYTES; // see setSendBudget()
+    uint16_t sendBudgetMs = FTP_SEND_BUDGET_MS;
+
+    MapFileFunction mapFileFunction = nullptr; // see setMapFileFunction()
+    const uint8_t *mappedFile = NULL;           // contents of file if mapped by mapFile()
 
     uint32_t millisBeginTrans; // store time of beginning of a transaction
     uint32_t bytesTransfered;  // bytes transfered
+    uint32_t fileOffset = 0;   // file position the transfer started at (restarted transfers)
+    uint32_t transferLimit = 0; // net->fs: stop after receiving this many bytes (0: no limit)
+    bool sharedFile = false;    // file is shared with other transfers: seek before writing, don't close it
 };
 
 #endif // FTP_COMMON_H
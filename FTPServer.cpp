@@ -34,41 +34,377 @@
 #include <stdarg.h>
 
 WiFiServer controlServer(FTP_CTRL_PORT);
-WiFiServer dataServer(FTP_DATA_PORT_PASV);
 
 // some constants
 static const char aSpace[] PROGMEM = " ";
 static const char aSlash[] PROGMEM = "/";
+static const char aEmpty[] = "";
+static const char aMonths[] PROGMEM = "JanFebMarAprMayJunJulAugSepOctNovDec";
+static const char aDigits[] PROGMEM = // two digit numbers 00 .. 99
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+//
+// broken down UTC time, see civilTime()
+//
+typedef struct
+{
+  uint16_t year;
+  uint8_t month; // 1..12
+  uint8_t day;   // 1..31
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+} civilTime_t;
+
+// break down a timestamp without gmtime_r(), days since the epoch are
+// converted to a date with H. Hinnant's civil_from_days() algorithm
+static void civilTime(time_t t, civilTime_t &ct)
+{
+  uint32_t secs = (t < 0) ? 0 : (uint32_t)t;
+  uint32_t days = secs / 86400 + 719468; // days since 0000-03-01
+  secs %= 86400;
+  ct.hour = secs / 3600;
+  ct.minute = (secs / 60) % 60;
+  ct.second = secs % 60;
+
+  uint32_t era = days / 146097;
+  uint32_t doe = days - era * 146097;                                  // [0, 146096]
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);              // [0, 365]
+  uint32_t mp = (5 * doy + 2) / 153;                                   // [0, 11], March = 0
+  ct.day = doy - (153 * mp + 2) / 5 + 1;
+  ct.month = (mp < 10) ? mp + 3 : mp - 9;
+  ct.year = yoe + era * 400 + (ct.month <= 2);
+}
+
+// copy the two digits of v (0..99) to b, returns position after them
+static char *putDigits(char *b, uint8_t v)
+{
+  memcpy_P(b, aDigits + 2 * v, 2);
+  return b + 2;
+}
 
 // constructor
 FTPServer::FTPServer(FS &_FSImplementation) : FTPCommon(_FSImplementation)
 {
-  aTimeout.resetToNeverExpires();
 }
 
-void FTPServer::begin(const String &uname, const String &pword)
+FTPServer::~FTPServer()
+{
+  stop();
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; ++i)
+  {
+    delete sessions[i];
+    sessions[i] = nullptr;
+  }
+  for (uint8_t i = 0; i < FTP_PASV_LISTENERS; ++i)
+  {
+    delete pasvPool[i].listener;
+    pasvPool[i].listener = nullptr;
+  }
+  delete[] dirCache;
+}
+
+void FTPServer::begin(const String &uname, const String &pword, uint8_t maxSessions)
 {
   _FTP_USER = uname;
   _FTP_PASS = pword;
 
-  iniVariables();
+  _maxSessions = maxSessions;
+  if (_maxSessions > FTP_MAX_SESSIONS)
+    _maxSessions = FTP_MAX_SESSIONS;
+  if (_maxSessions == 0)
+    _maxSessions = 1;
 
   // Tells the ftp server to begin listening for incoming connections
+  // (passive data ports are opened on demand by the PASV command)
   controlServer.begin();
-  dataServer.begin();
+}
+
+void FTPServer::setPassivePorts(uint16_t firstPort, uint16_t count)
+{
+  _pasvFirstPort = firstPort;
+  _pasvPortCount = count ? count : 1;
+  pasvNextPort = 0;
 }
 
 void FTPServer::stop()
 {
-  abortTransfer();
-  disconnectClient(false);
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; ++i)
+  {
+    if (sessions[i])
+      sessions[i]->stop();
+  }
   controlServer.stop();
-  dataServer.stop();
+  for (uint8_t i = 0; i < FTP_PASV_LISTENERS; ++i)
+  {
+    if (pasvPool[i].owner)
+      releasePassivePort(pasvPool[i].owner);
+  }
 
   FTPCommon::stop();
 }
 
-void FTPServer::iniVariables()
+void FTPServer::handleFTP()
+{
+  // let each session process its control and data connection
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; ++i)
+  {
+    if (sessions[i])
+      sessions[i]->handleFTP();
+  }
+
+  // hand a new control connection over to a free session
+  if (controlServer.hasClient())
+  {
+    WiFiClient client = controlServer.available();
+    FTPSession *session = getFreeSession();
+    if (session)
+    {
+      session->begin(client);
+    }
+    else
+    {
+      FTP_DEBUG_MSG("No free session, rejecting connection from %s:%d",
+                    client.remoteIP().toString().c_str(), client.remotePort());
+      client.printf_P(PSTR("421 Too many users, try again later.\r\n"));
+      client.stop();
+    }
+  }
+}
+
+uint8_t FTPServer::sessionCount() const
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; ++i)
+  {
+    if (sessions[i] && !sessions[i]->isFree())
+      ++count;
+  }
+  return count;
+}
+
+const FTPServer::PassiveStats &FTPServer::passiveStats() const
+{
+  return pasvStats;
+}
+
+//
+// start listening on a passive data port for the given session,
+// ports are taken round robin from the configured range so that consecutive
+// transfers don't re-use a port that might still be in TIME_WAIT
+//
+// returns the listener or NULL if the pool is exhausted, port receives the port number
+//
+WiFiServer *FTPServer::acquirePassivePort(FTPSession *session, uint16_t &port)
+{
+  ++pasvStats.requests;
+
+  // a session listens on one port at most
+  releasePassivePort(session);
+
+  // find a free listener
+  PassiveListener *pl = NULL;
+  for (uint8_t i = 0; i < FTP_PASV_LISTENERS && NULL == pl; ++i)
+  {
+    if (NULL == pasvPool[i].owner)
+      pl = &pasvPool[i];
+  }
+
+  // find the next port which is not in use by any other listener
+  for (uint16_t n = 0; pl && n < _pasvPortCount; ++n)
+  {
+    uint16_t p = _pasvFirstPort + pasvNextPort;
+    pasvNextPort = (pasvNextPort + 1) % _pasvPortCount;
+
+    bool inUse = false;
+    for (uint8_t i = 0; i < FTP_PASV_LISTENERS && !inUse; ++i)
+    {
+      inUse = (pasvPool[i].owner && pasvPool[i].port == p);
+    }
+    if (inUse)
+      continue;
+
+    if (NULL == pl->listener)
+      pl->listener = new WiFiServer(p);
+    if (NULL == pl->listener)
+      break;
+    pl->listener->begin(p);
+    pl->owner = session;
+    pl->port = p;
+    port = p;
+
+    if (++pasvStats.inUse > pasvStats.highWater)
+      pasvStats.highWater = pasvStats.inUse;
+    FTP_DEBUG_MSG("Passive data port %u listening", p);
+    return pl->listener;
+  }
+
+  ++pasvStats.exhausted;
+  FTP_DEBUG_MSG("Passive port pool exhausted (%u listeners, %u ports)", FTP_PASV_LISTENERS, _pasvPortCount);
+  return NULL;
+}
+
+//
+// stop listening on the passive data port of the given session (if any)
+//
+void FTPServer::releasePassivePort(FTPSession *session)
+{
+  for (uint8_t i = 0; i < FTP_PASV_LISTENERS; ++i)
+  {
+    if (pasvPool[i].owner == session)
+    {
+      pasvPool[i].listener->stop();
+      pasvPool[i].owner = NULL;
+      pasvPool[i].port = 0;
+      --pasvStats.inUse;
+    }
+  }
+}
+
+void FTPServer::setDirCache(uint8_t entries)
+{
+  delete[] dirCache;
+  dirCache = NULL;
+  dirCacheNext = 0;
+  dirStats = {};
+  if (entries)
+  {
+    dirCache = new DirCacheEntry[entries];
+    if (dirCache)
+      dirStats.entries = entries;
+  }
+}
+
+const FTPServer::DirCacheStats &FTPServer::dirCacheStats() const
+{
+  return dirStats;
+}
+
+void FTPServer::dirCacheAdd(const String &path, uint32_t size, time_t lastWrite, bool isDir)
+{
+  if (NULL == dirCache)
+    return;
+
+  // a file being uploaded still changes, don't cache it
+  for (uint8_t i = 0; i < FTP_MAX_SESSIONS; ++i)
+  {
+    if (sessions[i] && sessions[i]->isStoring(path))
+      return;
+  }
+
+  // update the entry if already cached, else replace the oldest one
+  DirCacheEntry *e = NULL;
+  for (uint8_t i = 0; i < dirStats.entries && NULL == e; ++i)
+  {
+    if (dirCache[i].path == path)
+      e = &dirCache[i];
+  }
+  if (NULL == e)
+  {
+    e = &dirCache[dirCacheNext];
+    dirCacheNext = (dirCacheNext + 1) % dirStats.entries;
+    e->path = path;
+  }
+  e->size = size;
+  e->lastWrite = lastWrite;
+  e->isDir = isDir;
+}
+
+const FTPServer::DirCacheEntry *FTPServer::dirCacheFind(const String &path)
+{
+  if (NULL == dirCache)
+    return NULL;
+
+  for (uint8_t i = 0; i < dirStats.entries; ++i)
+  {
+    if (dirCache[i].path.length() && dirCache[i].path == path)
+    {
+      ++dirStats.hits;
+      return &dirCache[i];
+    }
+  }
+  ++dirStats.misses;
+  return NULL;
+}
+
+void FTPServer::dirCacheInvalidate(const String &path)
+{
+  if (NULL == dirCache)
+    return;
+
+  for (uint8_t i = 0; i < dirStats.entries; ++i)
+  {
+    const String &p = dirCache[i].path;
+    if (p.startsWith(path) && (p.length() == path.length() || p[path.length()] == '/'))
+      dirCache[i].path.clear();
+  }
+}
+
+FTPSession *FTPServer::getFreeSession()
+{
+  // re-use an idle session first
+  for (uint8_t i = 0; i < _maxSessions; ++i)
+  {
+    if (sessions[i] && sessions[i]->isFree())
+      return sessions[i];
+  }
+  // then create a new one (if allowed)
+  for (uint8_t i = 0; i < _maxSessions; ++i)
+  {
+    if (NULL == sessions[i])
+    {
+      sessions[i] = new FTPSession(*this, THEFS);
+      return sessions[i];
+    }
+  }
+  return NULL;
+}
+
+// session constructor
+FTPSession::FTPSession(FTPServer &_server, FS &_FSImplementation) : FTPCommon(_FSImplementation), server(_server)
+{
+  aTimeout.resetToNeverExpires();
+  iniVariables();
+}
+
+void FTPSession::begin(const WiFiClient &client)
+{
+  iniVariables();
+
+  // settings are inherited from the server
+  inheritSettings(server);
+
+  control = client;
+
+  // wait 10s for login command
+  aTimeout.reset(10 * 1000);
+  cmdState = cCheck;
+}
+
+void FTPSession::stop()
+{
+  abortTransfer();
+  if (control.connected())
+    disconnectClient(false);
+  cmdState = cInit;
+
+  FTPCommon::stop();
+}
+
+bool FTPSession::isStoring(const String &path) const
+{
+  return transferState == tStore && storePath == path;
+}
+
+bool FTPSession::isFree() const
+{
+  // (not in cInit: the previous client's connection and files are not cleaned up yet)
+  return cmdState == cWait;
+}
+
+void FTPSession::iniVariables()
 {
   // Default Data connection is Active
   dataPassiveConn = true;
@@ -80,18 +416,36 @@ void FTPServer::iniVariables()
   cmdState = cInit;
   transferState = tIdle;
   rnFrom.clear();
+  restartPos = 0;
 
   // reset control connection input buffer, clear previous command
-  cmdLine.clear();
-  cmdString.clear();
-  parameters.clear();
+  cmdLineLen = 0;
+  cmdLineEnd = 0;
+  cmdScan = 0;
+  cmdLineTooLong = false;
+  cmdString = parameters = aEmpty;
   command = 0;
 
+  // drop what's left of the previous client's transfer (transferState is reset
+  // already, so abortTransfer() wouldn't)
+  storeEnded();
+  file.close();
+#if (defined ESP8266)
+  listDir = Dir();
+#elif (defined ESP32)
+  listDir.close();
+#endif
+  data.stop();
+
   // free any used fileBuffer
   freeBuffer();
+
+  // stop listening on a passive data port
+  server.releasePassivePort(this);
+  dataServer = NULL;
 }
 
-void FTPServer::handleFTP()
+void FTPSession::handleFTP()
 {
   //
   // control connection state sequence is
@@ -99,7 +453,7 @@ void FTPServer::handleFTP()
   //    |
   //    V
   //  cWait
-  //    |
+  //    |  (FTPServer hands over a new control connection)
   //    V
   //  cCheck -----------+
   //    |               | (no username but password set)
@@ -127,16 +481,9 @@ void FTPServer::handleFTP()
     iniVariables();
     cmdState = cWait;
   }
-  else if (cmdState == cWait) // FTP control server waiting for connection
+  else if (cmdState == cWait) // session is free, waiting for FTPServer to assign a connection
   {
-    if (controlServer.hasClient())
-    {
-      control = controlServer.available();
-
-      // wait 10s for login command
-      aTimeout.reset(10 * 1000);
-      cmdState = cCheck;
-    }
+    return;
   }
 
   else if (cmdState == cCheck) // FTP control server check/setup control connection
@@ -148,11 +495,11 @@ void FTPServer::handleFTP()
 
       sendMessage_P(220, PSTR("(espFTP " FTP_SERVER_VERSION ")"));
 
-      if (_FTP_USER.length())
+      if (server._FTP_USER.length())
       {
         cmdState = cUserId;
       }
-      else if (_FTP_PASS.length())
+      else if (server._FTP_PASS.length())
       {
         cmdState = cPassword;
       }
@@ -175,19 +522,22 @@ void FTPServer::handleFTP()
   //
   else if (readChar() > 0)
   {
-    // enforce USER than PASS commands before anything else except the FEAT command
-    // that should be supported to indicate server features even before login
-    if ((FTP_CMD(FEAT) != command) && (((cmdState == cUserId) && (FTP_CMD(USER) != command)) ||
-                                       ((cmdState == cPassword) && (FTP_CMD(PASS) != command))))
+    const Command *cmd = findCommand(command);
+
+    // enforce USER than PASS commands before anything else except commands that
+    // need no login, e.g. FEAT to indicate server features even before login
+    if ((cmdState != cProcess) && ((NULL == cmd) || (cmd->flags & needsLogin) ||
+                                   ((cmdState == cUserId) && (FTP_CMD(PASS) == command)) ||
+                                   ((cmdState == cPassword) && (FTP_CMD(USER) == command))))
     {
       sendMessage_P(530, PSTR("Please login with USER and PASS."));
-      FTP_DEBUG_MSG("ignoring before login: command %s [%x], params='%s'", cmdString.c_str(), command, parameters.c_str());
+      FTP_DEBUG_MSG("ignoring before login: command %s [%x], params='%s'", cmdString, command, parameters);
       command = 0;
       return;
     }
 
     // process the command
-    int8_t rc = processCommand();
+    int8_t rc = processCommand(cmd);
     // returns
     // -1 : command processing indicates, we have to close control (e.g. QUIT)
     //  0 : not yet finished, just call processCommend() again
@@ -204,7 +554,7 @@ void FTPServer::handleFTP()
       // command was successful, update command state
       if (cmdState == cUserId)
       {
-        if (_FTP_PASS.length())
+        if (server._FTP_PASS.length())
         {
           // wait 10s for PASS command
           aTimeout.reset(10 * 1000);
@@ -264,10 +614,18 @@ void FTPServer::handleFTP()
         transferState = tIdle;
       }
     }
+    else if (transferState == tList) // List directory
+    {
+      if (!doListing())
+      {
+        closeListing();
+        transferState = tIdle;
+      }
+    }
   }
 }
 
-void FTPServer::disconnectClient(bool gracious)
+void FTPSession::disconnectClient(bool gracious)
 {
   FTP_DEBUG_MSG("Disconnecting client");
   abortTransfer();
@@ -282,614 +640,1015 @@ void FTPServer::disconnectClient(bool gracious)
   control.stop();
 }
 
-int8_t FTPServer::processCommand()
+int8_t FTPSession::processCommand(const Command *cmd)
 {
-  // assume successful operation by default
-  int8_t rc = 1;
-
-  // make the full path of parameters (even if this makes no sense for all commands)
-  String path = getFileName(parameters, true);
-  FTP_DEBUG_MSG("processing: command %s [%x], params='%s' (cwd='%s')", cmdString.c_str(), command, parameters.c_str(), cwd.c_str());
-
-  ///////////////////////////////////////
-  //                                   //
-  //      ACCESS CONTROL COMMANDS      //
-  //                                   //
-  ///////////////////////////////////////
+  FTP_DEBUG_MSG("processing: command %s [%x], params='%s' (cwd='%s')", cmdString, command, parameters, cwd.c_str());
 
   //
-  //  USER - Provide username
+  //  Unrecognized commands ...
   //
-  if (FTP_CMD(USER) == command)
+  if (NULL == cmd)
   {
-    if (_FTP_USER.length() && (_FTP_USER != parameters))
-    {
-      sendMessage_P(430, PSTR("User not found."));
-      command = 0;
-      rc = 0;
-    }
-    else
-    {
-      FTP_DEBUG_MSG("USER ok");
-    }
+    FTP_DEBUG_MSG("Unknown command: %s, params: '%s')", cmdString, parameters);
+    sendMessage_P(500, PSTR("unknown command \"%s\""), cmdString);
+    return 1;
   }
 
-  //
-  //  PASS - Provide password
-  //
-  else if (FTP_CMD(PASS) == command)
+  // only one transfer at a time
+  if ((cmd->flags & needsData) && (transferState != tIdle))
   {
-    if (_FTP_PASS.length() && (_FTP_PASS != parameters))
-    {
-      sendMessage_P(430, PSTR("Password invalid."));
-      command = 0;
-      rc = 0;
-    }
-    else
-    {
-      FTP_DEBUG_MSG("PASS ok");
-    }
+    sendMessage_P(425, PSTR("Transfer in progress."));
+    return 1;
   }
 
-  //
-  //  QUIT
-  //
-  else if (FTP_CMD(QUIT) == command)
+  // make the full path of parameters (only for commands that take a path)
+  String path;
+  if (cmd->flags & needsPath)
+    path = getFileName(parameters, true);
+
+  return (this->*(cmd->handler))(path);
+}
+
+//
+// command table, sorted by command code (i.e. alphabetically) for a binary search
+//
+constexpr FTPSession::Command FTPSession::commandTable[] = {
+    {FTP_CMD(ABOR), needsLogin, &FTPSession::cmdABOR},
+    {FTP_CMD(APPE), needsLogin | needsPath | needsData, &FTPSession::cmdSTOR},
+    {FTP_CMD(CDUP), needsLogin, &FTPSession::cmdCDUP},
+    {FTP_CMD(CWD), needsLogin | needsPath, &FTPSession::cmdCWD},
+    {FTP_CMD(DELE), needsLogin | needsPath, &FTPSession::cmdDELE},
+    {FTP_CMD(FEAT), 0, &FTPSession::cmdFEAT},
+    {FTP_CMD(HELP), 0, &FTPSession::cmdHELP},
+    {FTP_CMD(LIST), needsLogin | needsPath | needsData, &FTPSession::cmdLIST},
+    {FTP_CMD(MDTM), needsLogin | isFeature | needsPath, &FTPSession::cmdMDTM},
+    {FTP_CMD(MKD), needsLogin | needsPath, &FTPSession::cmdMKD},
+    {FTP_CMD(MLSD), needsLogin | isFeature | needsPath | needsData, &FTPSession::cmdLIST},
+    {FTP_CMD(MODE), needsLogin, &FTPSession::cmdMODE},
+    {FTP_CMD(NLST), needsLogin | needsPath | needsData, &FTPSession::cmdLIST},
+    {FTP_CMD(NOOP), needsLogin, &FTPSession::cmdNOOP},
+    {FTP_CMD(PASS), 0, &FTPSession::cmdPASS},
+    {FTP_CMD(PASV), needsLogin, &FTPSession::cmdPASV},
+    {FTP_CMD(PORT), needsLogin, &FTPSession::cmdPORT},
+    {FTP_CMD(PWD), needsLogin, &FTPSession::cmdPWD},
+    {FTP_CMD(QUIT), 0, &FTPSession::cmdQUIT},
+    {FTP_CMD(REST), needsLogin | isFeature, &FTPSession::cmdREST},
+    {FTP_CMD(RETR), needsLogin | needsPath | needsData, &FTPSession::cmdRETR},
+    {FTP_CMD(RMD), needsLogin | needsPath, &FTPSession::cmdRMD},
+    {FTP_CMD(RNFR), needsLogin | needsPath, &FTPSession::cmdRNFR},
+    {FTP_CMD(RNTO), needsLogin | needsPath, &FTPSession::cmdRNTO},
+    {FTP_CMD(SITE), needsLogin | isFeature, &FTPSession::cmdSITE},
+    {FTP_CMD(SIZE), needsLogin | isFeature | needsPath, &FTPSession::cmdSIZE},
+    {FTP_CMD(STAT), needsLogin, &FTPSession::cmdSTAT},
+    {FTP_CMD(STOR), needsLogin | needsPath | needsData, &FTPSession::cmdSTOR},
+    {FTP_CMD(STRU), needsLogin, &FTPSession::cmdSTRU},
+    {FTP_CMD(SYST), needsLogin, &FTPSession::cmdSYST},
+    {FTP_CMD(TYPE), needsLogin, &FTPSession::cmdTYPE},
+    {FTP_CMD(USER), 0, &FTPSession::cmdUSER},
+};
+
+// check at compile time that the command table is sorted
+template <typename T>
+static constexpr bool sortedByCode(const T *table, size_t n)
+{
+  return (n < 2) || ((table[0].code < table[1].code) && sortedByCode(table + 1, n - 1));
+}
+
+const FTPSession::Command *FTPSession::findCommand(uint32_t code)
+{
+  static_assert(sortedByCode(commandTable, sizeof(commandTable) / sizeof(commandTable[0])),
+                "commandTable must be sorted by command code");
+
+  size_t lo = 0, hi = sizeof(commandTable) / sizeof(commandTable[0]);
+  while (lo < hi)
   {
-    disconnectClient();
-    rc = -1;
+    size_t mid = (lo + hi) / 2;
+    if (commandTable[mid].code == code)
+      return &commandTable[mid];
+    if (commandTable[mid].code < code)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return NULL;
+}
 
-  //
-  //  NOOP
-  //
-  else if (FTP_CMD(NOOP) == command)
+///////////////////////////////////////
+//                                   //
+//      ACCESS CONTROL COMMANDS      //
+//                                   //
+///////////////////////////////////////
+
+//
+//  USER - Provide username
+//
+int8_t FTPSession::cmdUSER(String &)
+{
+  int8_t rc = 1;
+
+  if (server._FTP_USER.length() && (server._FTP_USER != parameters))
   {
-    sendMessage_P(200, PSTR("Zzz..."));
+    sendMessage_P(430, PSTR("User not found."));
+    command = 0;
+    rc = 0;
+  }
+  else
+  {
+    FTP_DEBUG_MSG("USER ok");
   }
 
-  //
-  //  CDUP - Change to Parent Directory
-  //
-  else if (FTP_CMD(CDUP) == command)
+  return rc;
+}
+
+//
+//  PASS - Provide password
+//
+int8_t FTPSession::cmdPASS(String &)
+{
+  int8_t rc = 1;
+
+  if (server._FTP_PASS.length() && (server._FTP_PASS != parameters))
+  {
+    sendMessage_P(430, PSTR("Password invalid."));
+    command = 0;
+    rc = 0;
+  }
+  else
   {
-    // up one level
-    cwd = getPathName("", false);
-    sendMessage_P(250, PSTR("Directory successfully changed to \"%s\"."), cwd.c_str());
+    FTP_DEBUG_MSG("PASS ok");
   }
 
-  //
-  //  CWD - Change Working Directory
-  //
-  else if (FTP_CMD(CWD) == command)
+  return rc;
+}
+
+//
+//  QUIT
+//
+int8_t FTPSession::cmdQUIT(String &)
+{
+  int8_t rc = 1;
+
+  disconnectClient();
+  rc = -1;
+
+  return rc;
+}
+
+//
+//  NOOP
+//
+int8_t FTPSession::cmdNOOP(String &)
+{
+  sendMessage_P(200, PSTR("Zzz..."));
+  return 1;
+}
+
+//
+//  CDUP - Change to Parent Directory
+//
+int8_t FTPSession::cmdCDUP(String &)
+{
+  // up one level
+  cwd = getPathName(aEmpty, false);
+  sendMessage_P(250, PSTR("Directory successfully changed to \"%s\"."), cwd.c_str());
+  return 1;
+}
+
+//
+//  CWD - Change Working Directory
+//
+int8_t FTPSession::cmdCWD(String &path)
+{
+  int8_t rc = 1;
+
+  if (0 == strcmp_P(parameters, PSTR("."))) // 'CWD .' is the same as PWD command
   {
-    if (parameters == F(".")) // 'CWD .' is the same as PWD command
+    rc = cmdPWD(path);
+  }
+  else if (0 == strcmp_P(parameters, PSTR(".."))) // 'CWD ..' is the same as CDUP command
+  {
+    rc = cmdCDUP(path);
+  }
+  else
+  {
+#if (defined esp8266FTPServer_SPIFFS)
+    // SPIFFS has no directories, it's always ok
+    cwd = path;
+    sendMessage_P(250, PSTR("Directory successfully changed."));
+#else
+    // check if directory exists
+    const FTPServer::DirCacheEntry *e = server.dirCacheFind(path);
+    bool isDir;
+    if (e)
     {
-      command = FTP_CMD(PWD); // make CWD a PWD command ;-)
-      rc = 0;                 // indicate we need another processCommand() call
+      isDir = e->isDir;
     }
-    else if (parameters == F("..")) // 'CWD ..' is the same as CDUP command
+    else
     {
-      command = FTP_CMD(CDUP); // make CWD a CDUP command ;-)
-      rc = 0;                  // indicate we need another processCommand() call
+      file = THEFS.open(path, "r");
+      isDir = file.isDirectory();
+      file.close();
     }
-    else
+    if (isDir)
     {
-#if (defined esp8266FTPServer_SPIFFS)
-      // SPIFFS has no directories, it's always ok
       cwd = path;
       sendMessage_P(250, PSTR("Directory successfully changed."));
-#else
-      // check if directory exists
-      file = THEFS.open(path, "r");
-      if (file.isDirectory())
-      {
-        cwd = path;
-        sendMessage_P(250, PSTR("Directory successfully changed."));
-      }
-      else
-      {
-        sendMessage_P(550, PSTR("Failed to change directory."));
-      }
-      file.close();
-#endif
     }
+    else
+    {
+      sendMessage_P(550, PSTR("Failed to change directory."));
+    }
+#endif
   }
 
-  //
-  //  PWD - Print Directory
-  //
-  else if (FTP_CMD(PWD) == command)
-  {
-    sendMessage_P(257, PSTR("\"%s\" is the current directory."), cwd.c_str());
-  }
+  return rc;
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //    TRANSFER PARAMETER COMMANDS    //
-  //                                   //
-  ///////////////////////////////////////
+//
+//  PWD - Print Directory
+//
+int8_t FTPSession::cmdPWD(String &)
+{
+  sendMessage_P(257, PSTR("\"%s\" is the current directory."), cwd.c_str());
+  return 1;
+}
 
-  //
-  //  MODE - Transfer Mode
-  //
-  else if (FTP_CMD(MODE) == command)
+///////////////////////////////////////
+//                                   //
+//    TRANSFER PARAMETER COMMANDS    //
+//                                   //
+///////////////////////////////////////
+
+//
+//  MODE - Transfer Mode
+//
+int8_t FTPSession::cmdMODE(String &)
+{
+  if (0 == strcmp_P(parameters, PSTR("S")))
+    sendMessage_P(504, PSTR("Only S(tream) mode is suported"));
+  else
+    sendMessage_P(200, PSTR("Mode set to S."));
+  return 1;
+}
+
+//
+//  PASV - Passive data connection management
+//
+int8_t FTPSession::cmdPASV(String &)
+{
+  // the data connection of a running transfer must not be replaced
+  if (transferState != tIdle)
   {
-    if (parameters == F("S"))
-      sendMessage_P(504, PSTR("Only S(tream) mode is suported"));
-    else
-      sendMessage_P(200, PSTR("Mode set to S."));
+    sendMessage_P(425, PSTR("Transfer in progress."));
+    return 1;
   }
-
-  //
-  //  PASV - Passive data connection management
-  //
-  else if (FTP_CMD(PASV) == command)
+  // stop a possible previous data connection
+  data.stop();
+  dataPassiveConn = true;
+  // get a data port from the server's pool of passive ports
+  dataServer = server.acquirePassivePort(this, dataPort);
+  if (NULL == dataServer)
+  {
+    sendMessage_P(425, PSTR("No passive data port available, try again later."));
+  }
+  else
   {
-    // stop a possible previous data connection
-    data.stop();
     // tell client to open data connection to our ip:dataPort
-    dataPort = FTP_DATA_PORT_PASV;
-    dataPassiveConn = true;
     String ip = control.localIP().toString();
     ip.replace(".", ",");
     sendMessage_P(227, PSTR("Entering Passive Mode (%s,%d,%d)."), ip.c_str(), dataPort >> 8, dataPort & 255);
     //sendMessage_P(227, PSTR("Entering Passive Mode (0,0,0,0,%d,%d)."), dataPort >> 8, dataPort & 255);
   }
+  return 1;
+}
 
-  //
-  //  PORT - Data Port, Active data connection management
-  //
-  else if (FTP_CMD(PORT) == command)
+//
+//  PORT - Data Port, Active data connection management
+//
+int8_t FTPSession::cmdPORT(String &)
+{
+  if (transferState != tIdle)
   {
-    if (data)
-      data.stop();
+    sendMessage_P(425, PSTR("Transfer in progress."));
+    return 1;
+  }
+  if (data)
+    data.stop();
+
+  // no longer wait for a passive data connection
+  server.releasePassivePort(this);
+  dataServer = NULL;
+
+  if (parseDataIpPort(parameters))
+  {
+    dataPassiveConn = false;
+    sendMessage_P(200, PSTR("PORT command successful"));
+    FTP_DEBUG_MSG("Data connection management Active, using %s:%u", dataIP.toString().c_str(), dataPort);
+  }
+  else
+  {
+    sendMessage_P(501, PSTR("Cannot interpret parameters."));
+  }
+  return 1;
+}
+
+//
+//  STRU - File Structure
+//
+int8_t FTPSession::cmdSTRU(String &)
+{
+  if (0 == strcmp_P(parameters, PSTR("F")))
+    sendMessage_P(504, PSTR("Only F(ile) is suported"));
+  else
+    sendMessage_P(200, PSTR("Structure set to F."));
+  return 1;
+}
 
-    if (parseDataIpPort(parameters.c_str()))
+//
+//  TYPE - Data Type
+//
+int8_t FTPSession::cmdTYPE(String &)
+{
+  if (0 == strcmp_P(parameters, PSTR("A")))
+    sendMessage_P(200, PSTR("TYPE is now ASII."));
+  else if (0 == strcmp_P(parameters, PSTR("I")))
+    sendMessage_P(200, PSTR("TYPE is now 8-bit Binary."));
+  else
+    sendMessage_P(504, PSTR("Unrecognised TYPE."));
+  return 1;
+}
+
+///////////////////////////////////////
+//                                   //
+//        FTP SERVICE COMMANDS       //
+//                                   //
+///////////////////////////////////////
+
+//
+//  ABOR - Abort
+//
+int8_t FTPSession::cmdABOR(String &)
+{
+  abortTransfer();
+  sendMessage_P(226, PSTR("Data connection closed"));
+  return 1;
+}
+
+//
+//  DELE - Delete a File
+//
+int8_t FTPSession::cmdDELE(String &path)
+{
+  if (*parameters == '\0')
+    sendMessage_P(501, PSTR("No file name"));
+  else
+  {
+    if (!THEFS.exists(path))
     {
-      dataPassiveConn = false;
-      sendMessage_P(200, PSTR("PORT command successful"));
-      FTP_DEBUG_MSG("Data connection management Active, using %s:%u", dataIP.toString().c_str(), dataPort);
+      sendMessage_P(550, PSTR("Delete operation failed, file '%s' not found."), path.c_str());
+    }
+    else if (THEFS.remove(path))
+    {
+      server.dirCacheInvalidate(path);
+      sendMessage_P(250, PSTR("Delete operation successful."));
     }
     else
     {
-      sendMessage_P(501, PSTR("Cannot interpret parameters."));
+      sendMessage_P(450, PSTR("Delete operation failed."));
     }
   }
+  return 1;
+}
 
-  //
-  //  STRU - File Structure
-  //
-  else if (FTP_CMD(STRU) == command)
+//
+//  LIST - List directory contents
+//  MLSD - Listing for Machine Processing (see RFC 3659)
+//  NLST - Name List
+//
+int8_t FTPSession::cmdLIST(String &path)
+{
+  int8_t rc = 1;
+
+  rc = dataConnect(); // returns -1: no data connection, 0: need more time, 1: data ok
+  if (rc < 0)
   {
-    if (parameters == F("F"))
-      sendMessage_P(504, PSTR("Only F(ile) is suported"));
-    else
-      sendMessage_P(200, PSTR("Structure set to F."));
+    sendMessage_P(425, PSTR("No data connection"));
+    data.stop();
+    rc = 1; // mark command as processed
   }
-
-  //
-  //  TYPE - Data Type
-  //
-  else if (FTP_CMD(TYPE) == command)
+  else if (rc > 0)
   {
-    if (parameters == F("A"))
-      sendMessage_P(200, PSTR("TYPE is now ASII."));
-    else if (parameters == F("I"))
-      sendMessage_P(200, PSTR("TYPE is now 8-bit Binary."));
-    else
-      sendMessage_P(504, PSTR("Unrecognised TYPE."));
+    // the listing lines are staged in the transfer buffer, one MSS is enough
+    if (!allocateBuffer(BUFFERSIZE))
+    {
+      data.stop();
+      sendMessage_P(451, PSTR("Internal error. Not enough memory."));
+      return rc;
+    }
+    sendMessage_P(150, PSTR("Accepted data connection"));
+
+    // filter out possible command parameters like "-a", given by some clients
+    // like FuseFS
+    int8_t dashPos = path.lastIndexOf(F("-"));
+    if (dashPos > 0)
+    {
+      path.remove(dashPos);
+    }
+    FTP_DEBUG_MSG("Listing content of '%s'", path.c_str());
+#if (defined ESP8266)
+    listDir = THEFS.openDir(path);
+#elif (defined ESP32)
+    listDir = THEFS.open(path);
+#endif
+    // entries are sent by handleFTP(), a few per call
+    listPath = path;
+    listPath.trim();
+    listCommand = command;
+    listCount = 0;
+    listFailed = false;
+    civilTime_t now;
+    civilTime(time(NULL), now); // LIST shows the year of files not from this year
+    listYear = now.year;
+    transferState = tList;
   }
 
-  ///////////////////////////////////////
-  //                                   //
-  //        FTP SERVICE COMMANDS       //
-  //                                   //
-  ///////////////////////////////////////
+  return rc;
+}
 
-  //
-  //  ABOR - Abort
-  //
-  else if (FTP_CMD(ABOR) == command)
+//
+// send the next (at most FTP_LIST_BATCH) entries of the directory listing,
+// returns false if the listing is complete or the data connection was lost
+//
+bool FTPSession::doListing()
+{
+  if (listFailed || !data.connected())
   {
-    abortTransfer();
-    sendMessage_P(226, PSTR("Data connection closed"));
+    listFailed = true;
+    return false;
   }
 
-  //
-  //  DELE - Delete a File
-  //
-  else if (FTP_CMD(DELE) == command)
+  for (uint8_t n = 0; n < FTP_LIST_BATCH; ++n)
   {
-    if (parameters.length() == 0)
-      sendMessage_P(501, PSTR("No file name"));
-    else
+#if (defined ESP8266)
+    if (!listDir.next())
     {
-      if (!THEFS.exists(path))
-      {
-        sendMessage_P(550, PSTR("Delete operation failed, file '%s' not found."), path.c_str());
-      }
-      else if (THEFS.remove(path))
+      return false;
+    }
+    file = listDir.openFile("r");
+#elif (defined ESP32)
+    file = listDir.openNextFile();
+    if (!file)
+    {
+      return false;
+    }
+#endif
+    bool isDir = file.isDirectory();
+    String fn = file.name();
+    uint32_t fs = file.size();
+    time_t lastWrite = file.getLastWrite();
+    char fileTime[dateTimeStrSize];
+    makeDateTimeStr(fileTime, lastWrite, listCommand, listYear);
+    file.close();
+    int16_t slashPos = fn.lastIndexOf(F("/"));
+    if (slashPos >= 0)
+    {
+      fn.remove(0, slashPos + 1);
+    }
+    server.dirCacheAdd(listPath + (listPath.endsWith(FPSTR(aSlash)) ? aEmpty : "/") + fn, fs, lastWrite, isDir);
+
+    if (FTP_CMD(LIST) == listCommand)
+    {
+      // unixperms  type userid   groupid      size time & date  name
+      // drwxrwsr-x    2 111      117          4096 Apr 01 12:45 aDirectory
+      // -rw-rw-r--    1 111      117        875315 Mar 23 17:29 aFile
+      stageListEntry(PSTR("%crw%cr-%cr-%c    %c    0    0  %8" PRINTu32 " %s %s\r\n"),
+                     isDir ? 'd' : '-',
+                     isDir ? 'x' : '-',
+                     isDir ? 'x' : '-',
+                     isDir ? 'x' : '-',
+                     isDir ? '2' : '1',
+                     isDir ? 0 : fs,
+                     fileTime,
+                     fn.c_str());
+    }
+    else if (FTP_CMD(MLSD) == listCommand)
+    {
+      // "modify=20170122163911;type=dir;UNIX.group=0;UNIX.mode=0775;UNIX.owner=0; dirname"
+      // "modify=20170121000817;size=12;type=file;UNIX.group=0;UNIX.mode=0644;UNIX.owner=0; filename"
+      if (isDir)
       {
-        sendMessage_P(250, PSTR("Delete operation successful."));
+        stageListEntry(PSTR("modify=%s;UNIX.group=0;UNIX.owner=0;UNIX.mode=0755;type=dir; %s\r\n"),
+                       fileTime, fn.c_str());
       }
       else
       {
-        sendMessage_P(450, PSTR("Delete operation failed."));
+        stageListEntry(PSTR("modify=%s;UNIX.group=0;UNIX.owner=0;UNIX.mode=0644;size=%" PRINTu32 ";type=file; %s\r\n"),
+                       fileTime, fs, fn.c_str());
       }
     }
+    else if (FTP_CMD(NLST) == listCommand)
+    {
+      stageListEntry(PSTR("%s\r\n"), fn.c_str());
+    }
+    ++listCount;
   }
+  return true;
+}
 
-  //
-  //  LIST - List directory contents
-  //  MLSD - Listing for Machine Processing (see RFC 3659)
-  //  NLST - Name List
-  //
-  else if ((FTP_CMD(LIST) == command) || (FTP_CMD(MLSD) == command) || (FTP_CMD(NLST) == command))
+//
+// format a listing line into the staging buffer (fileBuffer), the buffer is
+// sent when the line doesn't fit anymore
+//
+void FTPSession::stageListEntry(PGM_P fmt, ...)
+{
+  va_list ap;
+  for (uint8_t attempt = 0; attempt < 2; ++attempt)
   {
-    rc = dataConnect(); // returns -1: no data connection, 0: need more time, 1: data ok
-    if (rc < 0)
+    size_t space = fileBufferSize - stagedBytes;
+    va_start(ap, fmt);
+    int len = vsnprintf_P((char *)fileBuffer + stagedBytes, space, fmt, ap);
+    va_end(ap);
+    if (len >= 0 && (size_t)len < space)
+    {
+      stagedBytes += len;
+      return;
+    }
+    // line doesn't fit: send the staged lines and try again with an empty buffer
+    if (stagedBytes == 0)
     {
-      sendMessage_P(425, PSTR("No data connection"));
-      rc = 1; // mark command as processed
+      break;
     }
-    else if (rc > 0)
+    if (!flushListing())
     {
-      sendMessage_P(150, PSTR("Accepted data connection"));
-      uint16_t dirCount = 0;
+      listFailed = true;
+      return;
+    }
+  }
+  FTP_DEBUG_MSG("Listing entry dropped, too long for %u bytes buffer", fileBufferSize);
+}
 
-      // filter out possible command parameters like "-a", given by some clients
-      // like FuseFS
-      int8_t dashPos = path.lastIndexOf(F("-"));
-      if (dashPos > 0)
-      {
-        path.remove(dashPos);
-      }
-      FTP_DEBUG_MSG("Listing content of '%s'", path.c_str());
+//
+// send the staged listing lines in one write
+//
+bool FTPSession::flushListing()
+{
+  if (stagedBytes == 0)
+  {
+    return true;
+  }
+  size_t nb = data.write(fileBuffer, stagedBytes);
+  bool ok = (nb == stagedBytes);
+  stagedBytes = 0;
+  return ok;
+}
+
+//
+// listing done, close the data connection and report the number of entries
+// (or that the listing was cut off)
+//
+void FTPSession::closeListing()
+{
+  if (!flushListing())
+  {
+    listFailed = true;
+  }
+  freeBuffer();
 #if (defined ESP8266)
-      Dir dir = THEFS.openDir(path);
-      while (dir.next())
-      {
-        file = dir.openFile("r");
+  listDir = Dir();
 #elif (defined ESP32)
-      File dir = THEFS.open(path);
-      file = dir.openNextFile();
-      while (file)
-      {
-#endif
-        bool isDir = file.isDirectory();
-        String fn = file.name();
-        uint32_t fs = file.size();
-        String fileTime = makeDateTimeStr(file.getLastWrite());
-        file.close();
-        dashPos = fn.lastIndexOf(F("/"));
-        if (dashPos >= 0)
-        {
-          fn.remove(0, dashPos + 1);
-        }
-
-        if (FTP_CMD(LIST) == command)
-        {
-          // unixperms  type userid   groupid      size time & date  name
-          // drwxrwsr-x    2 111      117          4096 Apr 01 12:45 aDirectory
-          // -rw-rw-r--    1 111      117        875315 Mar 23 17:29 aFile
-          data.printf_P(PSTR("%crw%cr-%cr-%c    %c    0    0  %8" PRINTu32 " %s %s\r\n"),
-                        isDir ? 'd' : '-',
-                        isDir ? 'x' : '-',
-                        isDir ? 'x' : '-',
-                        isDir ? 'x' : '-',
-                        isDir ? '2' : '1',
-                        isDir ? 0 : fs,
-                        fileTime.c_str(),
-                        fn.c_str());
-          //data.printf_P(PSTR("+r,s%lu\r\n,\t%s\r\n"), (uint32_t)dir.fileSize(), fn.c_str());
-        }
-        else if (FTP_CMD(MLSD) == command)
-        {
-          // "modify=20170122163911;type=dir;UNIX.group=0;UNIX.mode=0775;UNIX.owner=0; dirname"
-          // "modify=20170121000817;size=12;type=file;UNIX.group=0;UNIX.mode=0644;UNIX.owner=0; filename"
-          data.printf_P(PSTR("modify=%s;UNIX.group=0;UNIX.owner=0;UNIX.mode="), fileTime.c_str());
-          if (isDir)
-          {
-            data.printf_P(PSTR("0755;type=dir; "));
-          }
-          else
-          {
-            data.printf_P(PSTR("0644;size=%" PRINTu32 ";type=file; "), fs);
-          }
-          data.printf_P(PSTR("%s\r\n"), fn.c_str());
-        }
-        else if (FTP_CMD(NLST) == command)
-        {
-          data.println(fn);
-        }
-        ++dirCount;
-#if (defined ESP32)
-        file = dir.openNextFile();
+  listDir.close();
 #endif
-      }
+  data.stop();
+  if (listFailed)
+  {
+    sendMessage_P(426, PSTR("Connection closed; listing incomplete"));
+  }
+  else
+  {
+    sendMessage_P(226, PSTR("%d matches total"), listCount);
+  }
+}
 
-      if (FTP_CMD(MLSD) == command)
-      {
-        control.println(F("226-options: -a -l\r\n"));
-      }
-      sendMessage_P(226, PSTR("%d matches total"), dirCount);
-    }
-    data.stop();
+//
+//  REST - Restart the next RETR/STOR at the given offset
+//
+int8_t FTPSession::cmdREST(String &)
+{
+  char *end;
+  uint32_t pos = strtoul(parameters, &end, 10);
+  if (('\0' == *parameters) || ('\0' != *end))
+  {
+    sendMessage_P(501, PSTR("Syntax error in parameters."));
   }
+  else
+  {
+    restartPos = pos;
+    sendMessage_P(350, PSTR("Restarting at %lu. Send STORE or RETRIEVE to initiate transfer."), restartPos);
+  }
+  return 1;
+}
 
-  //
-  //  RETR - Retrieve
-  //
-  else if (FTP_CMD(RETR) == command)
+//
+//  RETR - Retrieve
+//
+int8_t FTPSession::cmdRETR(String &path)
+{
+  int8_t rc = 1;
+
+  if (*parameters == '\0')
+  {
+    sendMessage_P(501, PSTR("No file name"));
+  }
+  else
   {
-    if (parameters.length() == 0)
+    // open the file if not opened before (when re-running processCommand() since data connetion needs time)
+    if (!file)
+      file = THEFS.open(path, "r");
+    if (!file)
+    {
+      sendMessage_P(550, PSTR("File \"%s\" not found."), parameters);
+    }
+    else if (file.isDirectory())
+    {
+      sendMessage_P(450, PSTR("Cannot open file \"%s\"."), parameters);
+    }
+    else if (restartPos > file.size())
     {
-      sendMessage_P(501, PSTR("No file name"));
+      sendMessage_P(554, PSTR("Restart position beyond end of file."));
+      file.close();
     }
     else
     {
-      // open the file if not opened before (when re-running processCommand() since data connetion needs time)
-      if (!file)
-        file = THEFS.open(path, "r");
-      if (!file)
-      {
-        sendMessage_P(550, PSTR("File \"%s\" not found."), parameters.c_str());
-      }
-      else if (file.isDirectory())
+      rc = dataConnect(); // returns -1: no data connection, 0: need more time, 1: data ok
+      if (rc < 0)
       {
-        sendMessage_P(450, PSTR("Cannot open file \"%s\"."), parameters.c_str());
+        sendMessage_P(425, PSTR("No data connection"));
+        rc = 1; // mark command as processed
       }
-      else
+      else if (rc > 0)
       {
-        rc = dataConnect(); // returns -1: no data connection, 0: need more time, 1: data ok
-        if (rc < 0)
+        transferState = tRetrieve;
+        millisBeginTrans = millis();
+        bytesTransfered = 0;
+        // REST given: continue at the restart position
+        fileOffset = restartPos;
+        if (fileOffset)
+          file.seek(fileOffset);
+        uint32_t fs = file.size() - fileOffset;
+        // a file mapped to memory needs no transfer buffer
+        if (mapFile() || allocateBuffer())
         {
-          sendMessage_P(425, PSTR("No data connection"));
-          rc = 1; // mark command as processed
+          FTP_DEBUG_MSG("Sending file '%s' (%lu bytes from %lu)", path.c_str(), fs, fileOffset);
+          sendMessage_P(150, PSTR("%lu bytes to download"), fs);
         }
-        else if (rc > 0)
+        else
         {
-          transferState = tRetrieve;
-          millisBeginTrans = millis();
-          bytesTransfered = 0;
-          uint32_t fs = file.size();
-          if (allocateBuffer())
-          {
-            FTP_DEBUG_MSG("Sending file '%s' (%lu bytes)", path.c_str(), fs);
-            sendMessage_P(150, PSTR("%lu bytes to download"), fs);
-          }
-          else
-          {
-            closeTransfer();
-            sendMessage_P(451, PSTR("Internal error. Not enough memory."));
-          }
+          closeTransfer();
+          sendMessage_P(451, PSTR("Internal error. Not enough memory."));
         }
       }
     }
   }
 
-  //
-  //  STOR - Store
-  //
-  else if (FTP_CMD(STOR) == command)
+  // a restart position applies to the next transfer command only
+  if (rc)
+    restartPos = 0;
+
+  return rc;
+}
+
+//
+//  STOR - Store
+//  APPE - Append
+//
+int8_t FTPSession::cmdSTOR(String &path)
+{
+  int8_t rc = 1;
+
+  if (*parameters == '\0')
   {
-    if (parameters.length() == 0)
+    sendMessage_P(501, PSTR("No file name."));
+  }
+  else
+  {
+    FTP_DEBUG_MSG("%s '%s'", cmdString, path.c_str());
+    server.dirCacheInvalidate(path);
+    if (!file && FTP_CMD(APPE) == command)
     {
-      sendMessage_P(501, PSTR("No file name."));
+      file = THEFS.open(path, "a"); // append to the file, create it if it doesn't exist
     }
-    else
+    else if (!file && restartPos)
     {
-      FTP_DEBUG_MSG("STOR '%s'", path.c_str());
-      if (!file)
+      // REST given: keep the file and continue writing at the restart position
+      file = THEFS.open(path, "r+");
+      if (file && (restartPos > file.size() || !file.seek(restartPos)))
       {
-        file = THEFS.open(path, "w"); // open file, truncate it if already exists
-        file.close();                    // this performs a sync on LittleFS so that the actual
-                                      // space used by the file in FS gets released
-        file = THEFS.open(path, "w"); // re-open file for writing
+        file.close();
+        sendMessage_P(554, PSTR("Restart position beyond end of file."));
+        restartPos = 0;
+        return 1;
       }
-      if (!file)
+    }
+    else if (!file)
+    {
+      file = THEFS.open(path, "w"); // open file, truncate it if already exists
+      file.close();                    // this performs a sync on LittleFS so that the actual
+                                    // space used by the file in FS gets released
+      file = THEFS.open(path, "w"); // re-open file for writing
+    }
+    if (!file)
+    {
+      sendMessage_P(451, PSTR("Cannot open/create \"%s\""), path.c_str());
+    }
+    else
+    {
+      rc = dataConnect(); // returns -1: no data connection, 0: need more time, 1: data ok
+      if (rc < 0)
       {
-        sendMessage_P(451, PSTR("Cannot open/create \"%s\""), path.c_str());
+        sendMessage_P(425, PSTR("No data connection"));
+        file.close();
+        rc = 1; // mark command as processed
       }
-      else
+      else if (rc > 0)
       {
-        rc = dataConnect(); // returns -1: no data connection, 0: need more time, 1: data ok
-        if (rc < 0)
+        transferState = tStore;
+        storePath = path;
+        millisBeginTrans = millis();
+        bytesTransfered = 0;
+        if (allocateBuffer())
         {
-          sendMessage_P(425, PSTR("No data connection"));
-          file.close();
-          rc = 1; // mark command as processed
+          FTP_DEBUG_MSG("Receiving file '%s' => %s", parameters, path.c_str());
+          sendMessage_P(150, PSTR("Connected to port %d"), dataPort);
         }
-        else if (rc > 0)
+        else
         {
-          transferState = tStore;
-          millisBeginTrans = millis();
-          bytesTransfered = 0;
-          if (allocateBuffer())
-          {
-            FTP_DEBUG_MSG("Receiving file '%s' => %s", parameters.c_str(), path.c_str());
-            sendMessage_P(150, PSTR("Connected to port %d"), dataPort);
-          }
-          else
-          {
-            closeTransfer();
-            sendMessage_P(451, PSTR("Internal error. Not enough memory."));
-          }
+          closeTransfer();
+          sendMessage_P(451, PSTR("Internal error. Not enough memory."));
         }
       }
     }
   }
 
-  //
-  //  MKD - Make Directory
-  //
-  else if (FTP_CMD(MKD) == command)
-  {
+  // a restart position applies to the next transfer command only
+  if (rc)
+    restartPos = 0;
+
+  return rc;
+}
+
+//
+//  MKD - Make Directory
+//
+int8_t FTPSession::cmdMKD(String &path)
+{
 #if (defined esp8266FTPServer_SPIFFS)
-    sendMessage_P(550, "Create directory operation failed."); //not support on SPIFFS
+  sendMessage_P(550, "Create directory operation failed."); //not support on SPIFFS
 #else
-    FTP_DEBUG_MSG("mkdir(%s)", path.c_str());
-    if (THEFS.mkdir(path))
-    {
-      sendMessage_P(257, PSTR("\"%s\" created."), path.c_str());
-    }
-    else
-    {
-      sendMessage_P(550, PSTR("Create directory operation failed."));
-    }
-#endif
+  FTP_DEBUG_MSG("mkdir(%s)", path.c_str());
+  if (THEFS.mkdir(path))
+  {
+    server.dirCacheInvalidate(path);
+    sendMessage_P(257, PSTR("\"%s\" created."), path.c_str());
   }
-
-  //
-  //  RMD - Remove a Directory
-  //
-  else if (FTP_CMD(RMD) == command)
+  else
   {
+    sendMessage_P(550, PSTR("Create directory operation failed."));
+  }
+#endif
+  return 1;
+}
+
+//
+//  RMD - Remove a Directory
+//
+int8_t FTPSession::cmdRMD(String &path)
+{
 #if (defined esp8266FTPServer_SPIFFS)
-    sendMessage_P(550, "Remove directory operation failed."); //not support on SPIFFS
+  sendMessage_P(550, "Remove directory operation failed."); //not support on SPIFFS
 #else
-    // check directory for files
+  // check directory for files
 #if (defined ESP8266)
-    Dir dir = THEFS.openDir(path);
-    if (dir.next())
-    {
+  Dir dir = THEFS.openDir(path);
+  if (dir.next())
+  {
 #elif (defined ESP32)
-    File dir = THEFS.open(path);
-    file = dir.openNextFile();
-    if (file)
-    {
-      file.close();
-#endif
-      //only delete if dir is empty!
-      sendMessage_P(550, PSTR("Remove directory operation failed, directory is not empty."));
-    }
-    else
-    {
-      THEFS.rmdir(path);
-      sendMessage_P(250, PSTR("Remove directory operation successful."));
-    }
+  File dir = THEFS.open(path);
+  file = dir.openNextFile();
+  if (file)
+  {
+    file.close();
 #endif
+    //only delete if dir is empty!
+    sendMessage_P(550, PSTR("Remove directory operation failed, directory is not empty."));
   }
-  //
-  //  RNFR - Rename From
-  //
-  else if (FTP_CMD(RNFR) == command)
+  else
+  {
+    THEFS.rmdir(path);
+    server.dirCacheInvalidate(path);
+    sendMessage_P(250, PSTR("Remove directory operation successful."));
+  }
+#endif
+  return 1;
+}
+
+//
+//  RNFR - Rename From
+//
+int8_t FTPSession::cmdRNFR(String &path)
+{
+  if (*parameters == '\0')
+    sendMessage_P(501, PSTR("No file name"));
+  else
   {
-    if (parameters.length() == 0)
-      sendMessage_P(501, PSTR("No file name"));
+    if (!THEFS.exists(path))
+      sendMessage_P(550, PSTR("File \"%s\" not found."), path.c_str());
     else
     {
-      if (!THEFS.exists(path))
-        sendMessage_P(550, PSTR("File \"%s\" not found."), path.c_str());
-      else
-      {
-        sendMessage_P(350, PSTR("RNFR accepted - file \"%s\" exists, ready for destination"), path.c_str());
-        rnFrom = path;
-      }
+      sendMessage_P(350, PSTR("RNFR accepted - file \"%s\" exists, ready for destination"), path.c_str());
+      rnFrom = path;
     }
   }
-  //
-  //  RNTO - Rename To
-  //
-  else if (FTP_CMD(RNTO) == command)
-  {
-    if (rnFrom.length() == 0)
-      sendMessage_P(503, PSTR("Need RNFR before RNTO"));
-    else if (parameters.length() == 0)
-      sendMessage_P(501, PSTR("No file name"));
-    else if (THEFS.exists(path))
-      sendMessage_P(553, PSTR("\"%s\" already exists."), parameters.c_str());
+  return 1;
+}
+
+//
+//  RNTO - Rename To
+//
+int8_t FTPSession::cmdRNTO(String &path)
+{
+  if (rnFrom.length() == 0)
+    sendMessage_P(503, PSTR("Need RNFR before RNTO"));
+  else if (*parameters == '\0')
+    sendMessage_P(501, PSTR("No file name"));
+  else if (THEFS.exists(path))
+    sendMessage_P(553, PSTR("\"%s\" already exists."), parameters);
+  else
+  {
+    FTP_DEBUG_MSG("Renaming '%s' to '%s'", rnFrom.c_str(), path.c_str());
+    server.dirCacheInvalidate(rnFrom);
+    server.dirCacheInvalidate(path);
+    if (THEFS.rename(rnFrom, path))
+      sendMessage_P(250, PSTR("File successfully renamed or moved"));
     else
-    {
-      FTP_DEBUG_MSG("Renaming '%s' to '%s'", rnFrom.c_str(), path.c_str());
-      if (THEFS.rename(rnFrom, path))
-        sendMessage_P(250, PSTR("File successfully renamed or moved"));
-      else
-        sendMessage_P(451, PSTR("Rename/move failure."));
-    }
-    rnFrom.clear();
+      sendMessage_P(451, PSTR("Rename/move failure."));
   }
+  rnFrom.clear();
+  return 1;
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //   EXTENSIONS COMMANDS (RFC 3659)  //
-  //                                   //
-  ///////////////////////////////////////
+///////////////////////////////////////
+//                                   //
+//   EXTENSIONS COMMANDS (RFC 3659)  //
+//                                   //
+///////////////////////////////////////
 
-  //
-  //  FEAT - New Features
-  //
-  else if (FTP_CMD(FEAT) == command)
+//
+//  FEAT - New Features
+//
+int8_t FTPSession::cmdFEAT(String &)
+{
+  int8_t rc = 1;
+
+  // advertise the commands flagged as feature in the command table
+  char name[5];
+  beginReply_P(211, PSTR("Features:"));
+  for (size_t i = 0; i < sizeof(commandTable) / sizeof(commandTable[0]); ++i)
   {
-    control.print(F("211-Features:\r\n  MLSD\r\n  MDTM\r\n  SITE\r\n  SIZE\r\n211 End.\r\n"));
-    command = 0; // clear command code and
-    rc = 0;      // return 0 to prevent progression of state machine in case FEAT was a command before login
+    if (commandTable[i].flags & isFeature)
+      replyLine_P(PSTR(" %s%s"), ftpCommandName(commandTable[i].code, name),
+                  (FTP_CMD(REST) == commandTable[i].code) ? PSTR(" STREAM") : aEmpty);
   }
+  endReply_P(PSTR("End."));
 
-  //
-  //  MDTM - File Modification Time (see RFC 3659)
-  //
-  else if (FTP_CMD(MDTM) == command)
+  command = 0; // clear command code and
+  rc = 0;      // return 0 to prevent progression of state machine in case FEAT was a command before login
+
+  return rc;
+}
+
+//
+//  HELP - List the implemented commands
+//
+int8_t FTPSession::cmdHELP(String &)
+{
+  int8_t rc = 1;
+
+  // eight commands per line
+  const size_t count = sizeof(commandTable) / sizeof(commandTable[0]);
+  char names[8 * 5 + 1];
+  beginReply_P(214, PSTR("The following commands are recognized."));
+  for (size_t i = 0; i < count; i += 8)
   {
-    file = THEFS.open(path, "r");
-    if ((!file) || (0 == parameters.length()))
-    {
-      sendMessage_P(550, PSTR("Unable to retrieve time"));
-    }
-    else
+    char *p = names;
+    for (size_t n = i; n < count && n < i + 8; ++n)
     {
-      sendMessage_P(213, PSTR("%s"), makeDateTimeStr(file.getLastWrite()).c_str());
+      *p++ = ' ';
+      ftpCommandName(commandTable[n].code, p);
+      p += strlen(p);
     }
-    file.close();
+    replyLine_P(PSTR("%s"), names);
   }
+  endReply_P(PSTR("Help OK."));
 
-  //
-  //  SIZE - Size of the file
-  //
-  else if (FTP_CMD(SIZE) == command)
+  command = 0; // like FEAT, HELP can be sent before login
+  rc = 0;
+
+  return rc;
+}
+
+//
+//  STAT - Server status (without argument)
+//
+int8_t FTPSession::cmdSTAT(String &)
+{
+  if (*parameters)
   {
-    file = THEFS.open(path, "r");
-    if ((!file) || (0 == parameters.length()))
-    {
-      sendMessage_P(450, PSTR("Cannot open file."));
-    }
-    else
-    {
-      sendMessage_P(213, PSTR("%lu"), (uint32_t)file.size());
-    }
-    file.close();
+    sendMessage_P(504, PSTR("Command not implemented for that parameter."));
+    return 1;
   }
 
-  //
-  //  SITE - System command
-  //
-  else if (FTP_CMD(SITE) == command)
+  beginReply_P(211, PSTR("FTP server status:"));
+  replyLine_P(PSTR(" Version " FTP_SERVER_VERSION));
+  replyLine_P(PSTR(" Connected to %s"), control.remoteIP().toString().c_str());
+  replyLine_P(PSTR(" Logged in as %s"), server._FTP_USER.length() ? server._FTP_USER.c_str() : PSTR("anonymous"));
+  replyLine_P(PSTR(" Data connection mode is %s"), dataPassiveConn ? PSTR("passive") : PSTR("active"));
+  replyLine_P(PSTR(" %s"), (transferState > tIdle) ? PSTR("Transfer in progress") : PSTR("No data connection"));
+  replyLine_P(PSTR(" %u of %u sessions in use"), server.sessionCount(), server._maxSessions);
+  endReply_P(PSTR("End of status"));
+
+  return 1;
+}
+
+//
+//  MDTM - File Modification Time (see RFC 3659)
+//
+int8_t FTPSession::cmdMDTM(String &path)
+{
+  const FTPServer::DirCacheEntry *e = server.dirCacheFind(path);
+  char fileTime[dateTimeStrSize];
+  if (e && *parameters)
   {
-    sendMessage_P(550, PSTR("SITE %s command not implemented."), parameters.c_str());
+    sendMessage_P(213, PSTR("%s"), makeDateTimeStr(fileTime, e->lastWrite, FTP_CMD(MDTM)));
+    return 1;
   }
 
-  //
-  //  SYST - System information
-  //
-  else if (FTP_CMD(SYST) == command)
+  file = THEFS.open(path, "r");
+  if ((!file) || ('\0' == *parameters))
   {
-    sendMessage_P(215, PSTR("UNIX Type: L8"));
+    sendMessage_P(550, PSTR("Unable to retrieve time"));
   }
+  else
+  {
+    sendMessage_P(213, PSTR("%s"), makeDateTimeStr(fileTime, file.getLastWrite(), FTP_CMD(MDTM)));
+  }
+  file.close();
+  return 1;
+}
 
-  //
-  //  Unrecognized commands ...
-  //
+//
+//  SIZE - Size of the file
+//
+int8_t FTPSession::cmdSIZE(String &path)
+{
+  const FTPServer::DirCacheEntry *e = server.dirCacheFind(path);
+  if (e && !e->isDir && *parameters)
+  {
+    sendMessage_P(213, PSTR("%lu"), e->size);
+    return 1;
+  }
+
+  file = THEFS.open(path, "r");
+  if ((!file) || ('\0' == *parameters))
+  {
+    sendMessage_P(450, PSTR("Cannot open file."));
+  }
   else
   {
-    FTP_DEBUG_MSG("Unknown command: %s, params: '%s')", cmdString.c_str(), parameters.c_str());
-    sendMessage_P(500, PSTR("unknown command \"%s\""), cmdString.c_str());
+    sendMessage_P(213, PSTR("%lu"), (uint32_t)file.size());
   }
+  file.close();
+  return 1;
+}
 
-  return rc;
+//
+//  SITE - System command
+//
+int8_t FTPSession::cmdSITE(String &)
+{
+  sendMessage_P(550, PSTR("SITE %s command not implemented."), parameters);
+  return 1;
+}
+
+//
+//  SYST - System information
+//
+int8_t FTPSession::cmdSYST(String &)
+{
+  sendMessage_P(215, PSTR("UNIX Type: L8"));
+  return 1;
 }
 
-int8_t FTPServer::dataConnect()
+int8_t FTPSession::dataConnect()
 {
   int8_t rc = 1; // assume success
 
@@ -905,11 +1664,19 @@ int8_t FTPServer::dataConnect()
     // wait for data connection from the client
     if (!data.connected())
     {
-      if (dataServer.hasClient())
+      if (NULL == dataServer)
+      {
+        // no PASV command before
+        rc = -1;
+      }
+      else if (dataServer->hasClient())
       {
         data.stop();
-        data = dataServer.available();
+        data = dataServer->available();
         FTP_DEBUG_MSG("Got incoming (passive) data connection from %s:%u", data.remoteIP().toString().c_str(), data.remotePort());
+        // one data connection per PASV, stop listening
+        server.releasePassivePort(this);
+        dataServer = NULL;
       }
       else
       {
@@ -921,24 +1688,31 @@ int8_t FTPServer::dataConnect()
   return rc;
 }
 
-void FTPServer::closeTransfer()
+void FTPSession::closeTransfer()
 {
   uint32_t deltaT = (int32_t)(millis() - millisBeginTrans);
   if (deltaT > 0 && bytesTransfered > 0)
   {
-    sendMessage_P(226, PSTR("File successfully transferred, %lu ms, %f kB/s."), deltaT, float(bytesTransfered) / deltaT);
+    sendMessage_P(226, PSTR("File successfully transferred, %lu ms, %f kB/s, buffer %u bytes."), deltaT, float(bytesTransfered) / deltaT, fileBufferSize);
   }
   else
     sendMessage_P(226, PSTR("File successfully transferred"));
 
   FTPCommon::closeTransfer();
+  storeEnded();
 }
 
-void FTPServer::abortTransfer()
+void FTPSession::abortTransfer()
 {
   if (transferState > tIdle)
   {
     file.close();
+    storeEnded();
+#if (defined ESP8266)
+    listDir = Dir();
+#elif (defined ESP32)
+    listDir.close();
+#endif
     data.stop();
     sendMessage_P(426, PSTR("Transfer aborted"));
   }
@@ -946,74 +1720,137 @@ void FTPServer::abortTransfer()
   transferState = tIdle;
 }
 
-// Read a char from client connected to ftp server
+//
+// a stored file was written (completely or in parts): entries cached by
+// listings of other sessions while it was written are outdated
+//
+void FTPSession::storeEnded()
+{
+  if (storePath.length())
+  {
+    server.dirCacheInvalidate(storePath);
+    storePath.clear();
+  }
+}
+
+// Read the command line from the client connected to ftp server
+//
+// bytes are read in bulk into cmdLine, the line is then split in place,
+// i.e. cmdString and parameters point into cmdLine (no heap allocations)
 //
 //  returns:
-//    -1 if cmdLine too long
 //     0 cmdLine still incomplete (no \r or \n received yet)
 //     1 cmdLine processed, command and parameters available
 
-int8_t FTPServer::readChar()
+int8_t FTPSession::readChar()
 {
   // only read/parse, if the previous command has been fully processed!
   if (command)
     return 1;
 
-  while (control.available())
+  while (true)
   {
-    char c = control.read();
-    // FTP_DEBUG_MSG("readChar() cmdLine='%s' <= %c", cmdLine.c_str(), c);
+    // drop the previous command line, keep the bytes received after it
+    if (cmdLineEnd)
+    {
+      cmdLineLen -= cmdLineEnd;
+      memmove(cmdLine, cmdLine + cmdLineEnd, cmdLineLen);
+      cmdLineEnd = 0;
+      cmdScan = 0;
+    }
 
-    // substitute '\' with '/'
-    if (c == '\\')
-      c = '/';
+    // search the end of line
+    while (cmdScan < cmdLineLen && cmdLine[cmdScan] != '\n' && cmdLine[cmdScan] != '\r')
+    {
+      // substitute '\' with '/'
+      if (cmdLine[cmdScan] == '\\')
+        cmdLine[cmdScan] = '/';
+      ++cmdScan;
+    }
 
     // nl detected? then process line
-    if (c == '\n' || c == '\r')
+    if (cmdScan < cmdLineLen)
     {
-      cmdLine.trim();
-
-      // but only if we got at least chars in the line!
-      if (0 == cmdLine.length())
-        break;
+      cmdLine[cmdScan] = '\0';
+      cmdLineEnd = cmdScan + 1;
 
-      // search for space between command and parameters
-      int pos = cmdLine.indexOf(FPSTR(aSpace));
-      if (pos > 0)
+      if (cmdLineTooLong)
       {
-        parameters = cmdLine.substring(pos + 1);
-        parameters.trim();
-        cmdLine.remove(pos);
+        // this was the remainder of a too long line
+        cmdLineTooLong = false;
+        continue;
       }
-      else
+      // but only if we got at least chars in the line!
+      if (parseCmdLine())
       {
-        parameters.remove(0);
+        // FTP_DEBUG_MSG("readChar() success, cmdString='%s' [%x], params='%s'", cmdString, command, parameters);
+        return 1;
       }
-      cmdString = cmdLine;
-
-      // convert command to upper case
-      cmdString.toUpperCase();
-
-      // convert the (up to 4 command chars to numerical value)
-      command = *(const uint32_t *)cmdString.c_str();
-
-      // clear cmdline
-      cmdLine.clear();
-      // FTP_DEBUG_MSG("readChar() success, cmdString='%s' [%x], params='%s'", cmdString.c_str(), command, parameters.c_str());
-      return 1;
+      continue;
     }
-    else
+
+    if (cmdLineLen >= FTP_CMD_SIZE)
     {
-      // just add char
-      cmdLine += c;
-      if (cmdLine.length() > FTP_CMD_SIZE)
-      {
-        cmdLine.clear();
+      // line too long: discard it up to the next end of line
+      if (!cmdLineTooLong)
         sendMessage_P(500, PSTR("Line too long"));
-      }
+      cmdLineTooLong = true;
+      cmdLineLen = 0;
+      cmdScan = 0;
     }
+
+    // read as many bytes as available and fit into cmdLine
+    int16_t navail = control.available();
+    if (navail <= 0)
+      return 0;
+    if (navail > FTP_CMD_SIZE - cmdLineLen)
+      navail = FTP_CMD_SIZE - cmdLineLen;
+    navail = control.read((uint8_t *)cmdLine + cmdLineLen, navail);
+    if (navail <= 0)
+      return 0;
+    cmdLineLen += navail;
+  }
+}
+
+// Split the (null terminated) command line in cmdLine into command and parameters
+//
+//  returns:
+//    false if the line is empty
+//    true  cmdString, parameters and command are set
+bool FTPSession::parseCmdLine()
+{
+  // trim white space
+  char *p = cmdLine;
+  while (*p == ' ' || *p == '\t')
+    ++p;
+  char *e = p + strlen(p);
+  while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+    *(--e) = '\0';
+  if (p == e)
+    return false;
+
+  // search for space between command and parameters
+  char *sp = strchr(p, ' ');
+  if (sp)
+  {
+    *sp++ = '\0';
+    while (*sp == ' ')
+      ++sp;
+    parameters = sp;
+  }
+  else
+  {
+    parameters = e;
   }
-  return 0;
+  cmdString = p;
+
+  // convert command to upper case
+  for (; *p; ++p)
+    *p = toupper(*p);
+
+  // convert the (up to 4 command chars to numerical value)
+  command = ftpCommandCode(cmdString);
+  return true;
 }
 
 // Get the complete path from cwd + parameters or complete filename from cwd + parameters
@@ -1023,7 +1860,7 @@ int8_t FTPServer::readChar()
 // returns:
 //    path WITHOUT file-/dirname (fullname=false)
 //    full path WITH file-/dirname (fullname=true)
-String FTPServer::getPathName(const String &param, bool fullname)
+String FTPSession::getPathName(const char *param, bool fullname)
 {
   String tmp;
 
@@ -1038,7 +1875,7 @@ String FTPServer::getPathName(const String &param, bool fullname)
     tmp = cwd;
 
     // if param != "" then add param
-    if (param.length())
+    if (*param)
     {
       if (!tmp.endsWith(FPSTR(aSlash)))
         tmp += '/';
@@ -1073,7 +1910,7 @@ String FTPServer::getPathName(const String &param, bool fullname)
 //
 // returns:
 //    filename or filename with complete path
-String FTPServer::getFileName(const String &param, bool fullFilePath)
+String FTPSession::getFileName(const char *param, bool fullFilePath)
 {
   // build the filename with full path
   String tmp = getPathName(param, true);
@@ -1093,82 +1930,147 @@ String FTPServer::getFileName(const String &param, bool fullFilePath)
 }
 
 //
-// Formats printable String from a time_t timestamp
+// Formats a time_t timestamp into buf (at least dateTimeStrSize bytes)
+//   FTP_CMD(MLSD), FTP_CMD(MDTM): "20200517123400"
+//   FTP_CMD(LIST): "May 17 12:34" for file dates of currentYear,
+//                  "May 17  2019" for file dates of any other year
 //
-String FTPServer::makeDateTimeStr(time_t ft)
+char *FTPSession::makeDateTimeStr(char *buf, time_t ft, uint32_t format, uint16_t currentYear)
 {
-  String tmp;
-  // a buffer with enough space for the formats
-  char buf[25];
-  char *b = buf;
-
-  // break down the provided file time
-  struct tm _tm;
-  gmtime_r(&ft, &_tm);
+  civilTime_t ct;
+  civilTime(ft, ct);
 
-  if (FTP_CMD(MLSD) == command)
+  char *b = buf;
+  if (FTP_CMD(MLSD) == format || FTP_CMD(MDTM) == format)
   {
-    // "%Y%m%d%H%M%S", e.g. "20200517123400"
-    strftime(b, sizeof(buf), "%Y%m%d%H%M%S", &_tm);
+    b = putDigits(b, ct.year / 100);
+    b = putDigits(b, ct.year % 100);
+    b = putDigits(b, ct.month);
+    b = putDigits(b, ct.day);
+    b = putDigits(b, ct.hour);
+    b = putDigits(b, ct.minute);
+    b = putDigits(b, ct.second);
   }
-  else if (FTP_CMD(LIST) == command)
+  else if (FTP_CMD(LIST) == format)
   {
-    // "%h %d %H:%M", e.g. "May 17 12:34" for file dates of the current year
-    // "%h %d  %Y"  , e.g. "May 17  2019" for file dates of any other years
-
-    // just convert both ways, select later what's to be shown
-    // buf becomes "May 17  2019May 17 12:34"
-    strftime(b, sizeof(buf), "%h %d %H:%M%h %d  %Y", &_tm);
-
-    // check for a year != year from now
-    int fileYear = _tm.tm_year;
-    time_t nowTime = time(NULL);
-    gmtime_r(&nowTime, &_tm);
-    if (fileYear == _tm.tm_year)
+    memcpy_P(b, aMonths + 3 * (ct.month - 1), 3);
+    b += 3;
+    *b++ = ' ';
+    b = putDigits(b, ct.day);
+    *b++ = ' ';
+    if (ct.year == currentYear)
     {
-      // cut off 2nd half - year variant
-      b[12] = '\0';
+      b = putDigits(b, ct.hour);
+      *b++ = ':';
+      b = putDigits(b, ct.minute);
     }
     else
     {
-      // skip 1st half - time variant
-      b += 12;
+      *b++ = ' ';
+      b = putDigits(b, ct.year / 100);
+      b = putDigits(b, ct.year % 100);
     }
   }
-  tmp = b;
-  return tmp;
+  *b = '\0';
+  return buf;
 }
 
 //
 //    send "code formatted string" + CR-LF
 //
-void FTPServer::sendMessage_P(int16_t code, PGM_P fmt, ...)
+void FTPSession::sendMessage_P(int16_t code, PGM_P fmt, ...)
+{
+  replyCode = code;
+  va_list ap;
+  va_start(ap, fmt);
+  addReplyLine(' ', fmt, ap);
+  va_end(ap);
+  flushReply();
+}
+
+//
+// multi-line replies (RFC 959): "<code>-<text>" first line, any number of
+// text lines and "<code> <text>" as last line. The lines are collected in the
+// reply buffer and sent with one write (more only if they don't fit)
+//
+void FTPSession::beginReply_P(int16_t code, PGM_P fmt, ...)
 {
-  FTP_DEBUG_MSG(">>> %d %s", code, fmt);
+  replyCode = code;
+  va_list ap;
+  va_start(ap, fmt);
+  addReplyLine('-', fmt, ap);
+  va_end(ap);
+}
 
-  int size = 0;
-  char *p = NULL;
+void FTPSession::replyLine_P(PGM_P fmt, ...)
+{
   va_list ap;
+  va_start(ap, fmt);
+  addReplyLine('\0', fmt, ap);
+  va_end(ap);
+}
 
-  /* Determine required size for a string buffer */
+void FTPSession::endReply_P(PGM_P fmt, ...)
+{
+  va_list ap;
   va_start(ap, fmt);
-  size = vsnprintf(p, size, fmt, ap);
+  addReplyLine(' ', fmt, ap);
   va_end(ap);
+  flushReply();
+}
 
-  if (size > 0)
+//
+// add a line to the reply buffer, mark '-' or ' ' puts the reply code and the
+// mark in front of the text, text that doesn't fit into the empty buffer is cut off
+//
+void FTPSession::addReplyLine(char mark, PGM_P fmt, va_list ap)
+{
+  for (;;)
   {
-    p = (char *)malloc(++size); // increase +1 for '\0'
-    if (p)
+    char *line = reply + replyLen;
+    int space = (int)sizeof(reply) - 2 - replyLen; // keep room for "\r\n"
+    int len = 0;
+    if (space > 4)
     {
-      va_start(ap, fmt);
-      size = vsnprintf(p, size, fmt, ap);
-      va_end(ap);
-
+      if (mark)
+      {
+        line[0] = '0' + (replyCode / 100) % 10;
+        line[1] = '0' + (replyCode / 10) % 10;
+        line[2] = '0' + replyCode % 10;
+        line[3] = mark;
+        len = 4;
+      }
+      va_list aq;
+      va_copy(aq, ap);
+      int size = vsnprintf_P(line + len, space - len, fmt, aq);
+      va_end(aq);
       if (size > 0)
       {
-        control.printf_P(PSTR("%d %s\r\n"), code, p);
+        len += size;
+      }
+      if (len < space || 0 == replyLen)
+      {
+        if (len >= space)
+        {
+          len = space - 1;
+        }
+        FTP_DEBUG_MSG(">>> %.*s", len, line);
+        line[len++] = '\r';
+        line[len++] = '\n';
+        replyLen += len;
+        return;
       }
-      free(p);
     }
+    // line doesn't fit behind the previous ones, send them first
+    flushReply();
+  }
+}
+
+void FTPSession::flushReply()
+{
+  if (replyLen)
+  {
+    control.write((const uint8_t *)reply, replyLen);
+    replyLen = 0;
   }
 }
@@ -29,26 +29,35 @@
  **                       DEFINITIONS FOR FTP SERVER/CLIENT                    **
  **                                                                            **
  *******************************************************************************/
+#include <stdarg.h>
+#include <WiFiServer.h>
 #include "FTPCommon.h"
 
-class FTPServer : public FTPCommon
+class FTPServer;
+
+// one client connected to the FTP server: its control and data connection,
+// current directory and transfer state
+class FTPSession : public FTPCommon
 {
 public:
-  // contruct an instance of the FTP server using a
-  // given FS object, e.g. SPIFFS or LittleFS
-  FTPServer(FS &_FSImplementation);
+  // contruct a session of the given FTP server
+  FTPSession(FTPServer &_server, FS &_FSImplementation);
 
-  // starts the FTP server with username and password,
-  // either one can be empty to enable anonymous ftp
-  void begin(const String &uname, const String &pword);
+  // take over a control connection accepted by the FTP server
+  void begin(const WiFiClient &client);
 
-  // stops the FTP server
+  // stops the session, i.e. stops control and data connections
   void stop();
 
-  // needs to be called frequently (e.g. in loop() )
-  // to process ftp requests
+  // called by FTPServer::handleFTP() to process the session's ftp requests
   void handleFTP();
 
+  // true if the session has no client and can take a new connection
+  bool isFree() const;
+
+  // true if the session is storing (STOR/APPE) the file path
+  bool isStoring(const String &path) const;
+
 private:
   enum internalState
   {
@@ -62,36 +71,215 @@ private:
 
     tIdle,
     tRetrieve,
-    tStore
+    tStore,
+    tList
+  };
+
+  // command dispatch
+  enum commandFlags
+  {
+    needsLogin = 0x01, // command is only accepted after login
+    needsPath = 0x02,  // command takes a path, built from cwd and parameters
+    needsData = 0x04,  // command uses the data connection (rejected while a transfer is running)
+    isFeature = 0x08,  // command is advertised by FEAT
   };
+  typedef int8_t (FTPSession::*commandHandler)(String &path);
+  typedef struct
+  {
+    uint32_t code;          // numeric command code, see FTP_CMD()
+    uint8_t flags;          // commandFlags
+    commandHandler handler; // returns -1: close control connection, 0: call again, 1: done
+  } Command;
+  static const Command commandTable[];
+  static const Command *findCommand(uint32_t code);
+
+  // command handlers
+  int8_t cmdUSER(String &path);
+  int8_t cmdPASS(String &path);
+  int8_t cmdQUIT(String &path);
+  int8_t cmdNOOP(String &path);
+  int8_t cmdCDUP(String &path);
+  int8_t cmdCWD(String &path);
+  int8_t cmdPWD(String &path);
+  int8_t cmdMODE(String &path);
+  int8_t cmdPASV(String &path);
+  int8_t cmdPORT(String &path);
+  int8_t cmdSTRU(String &path);
+  int8_t cmdTYPE(String &path);
+  int8_t cmdABOR(String &path);
+  int8_t cmdDELE(String &path);
+  int8_t cmdLIST(String &path);
+  int8_t cmdREST(String &path);
+  int8_t cmdRETR(String &path);
+  int8_t cmdSTOR(String &path);
+  int8_t cmdMKD(String &path);
+  int8_t cmdRMD(String &path);
+  int8_t cmdRNFR(String &path);
+  int8_t cmdRNTO(String &path);
+  int8_t cmdFEAT(String &path);
+  int8_t cmdHELP(String &path);
+  int8_t cmdSTAT(String &path);
+  int8_t cmdMDTM(String &path);
+  int8_t cmdSIZE(String &path);
+  int8_t cmdSITE(String &path);
+  int8_t cmdSYST(String &path);
 
   void iniVariables();
   void disconnectClient(bool gracious = true);
-  int8_t processCommand();
+  int8_t processCommand(const Command *cmd);
   virtual void closeTransfer();
   void abortTransfer();
+  void storeEnded(); // the stored file changed: drop its cached entry
+  bool doListing();   // send the next entries of a directory listing
+  void stageListEntry(PGM_P fmt, ...); // format a listing line into the staging buffer
+  bool flushListing();                 // send the staged listing lines
+  void closeListing();
 
   virtual int8_t dataConnect();
 
   void sendMessage_P(int16_t code, PGM_P fmt, ...);
-  String getPathName(const String &param, bool includeLast = false);
-  String getFileName(const String &param, bool fullFilePath = false);
-  String makeDateTimeStr(time_t fileTime);
+  void beginReply_P(int16_t code, PGM_P fmt, ...); // multi-line reply: first line
+  void replyLine_P(PGM_P fmt, ...);                // multi-line reply: text line
+  void endReply_P(PGM_P fmt, ...);                 // multi-line reply: last line, sends the reply
+  void addReplyLine(char mark, PGM_P fmt, va_list ap);
+  void flushReply();
+  String getPathName(const char *param, bool includeLast = false);
+  String getFileName(const char *param, bool fullFilePath = false);
+  static const uint8_t dateTimeStrSize = 15; // buffer size needed by makeDateTimeStr()
+  char *makeDateTimeStr(char *buf, time_t fileTime, uint32_t format, uint16_t currentYear = 0); // format: FTP_CMD(LIST), FTP_CMD(MLSD) or FTP_CMD(MDTM)
   int8_t readChar();
+  bool parseCmdLine();
 
-  // server specific
+  FTPServer &server;             // the server this session belongs to
+  WiFiServer *dataServer = NULL; // passive data port listener assigned by the server
+
+  // session specific
   bool dataPassiveConn = true; // PASV (passive) mode is our default
-  String _FTP_USER;            // usename
-  String _FTP_PASS;            // password
   uint32_t command;            // numeric command code of command sent by the client
-  String cmdLine;              // command line as read from client
-  String cmdString;            // command as textual representation
-  String parameters;           // parameters sent by client
+  char cmdLine[FTP_CMD_SIZE + 1]; // command line as read from client
+  char reply[FTP_REPLY_SIZE];  // reply to the client, see sendMessage_P()
+  uint16_t replyLen = 0;       // bytes in reply not yet sent
+  int16_t replyCode;           // code of the reply being built
+  uint16_t cmdLineLen;         // number of bytes in cmdLine
+  uint16_t cmdScan;            // number of bytes in cmdLine already searched for the end of line
+  uint16_t cmdLineEnd;         // length of the current command line incl. end of line (0: none)
+  bool cmdLineTooLong;         // discard received bytes up to the next end of line
+  const char *cmdString;       // command as textual representation (points into cmdLine)
+  const char *parameters;      // parameters sent by client (points into cmdLine)
   String cwd;                  // the current directory
   String rnFrom;               // previous command was RNFR, this is the source file name
+  uint32_t restartPos;         // REST: offset the next RETR/STOR starts at
+  String storePath;            // file being stored (transferState tStore)
+
+  // directory listing in progress (transferState tList)
+#if (defined ESP8266)
+  Dir listDir;
+#elif (defined ESP32)
+  File listDir;
+#endif
+  String listPath;             // directory being listed
+  uint32_t listCommand;        // LIST, MLSD or NLST
+  uint16_t listCount;          // number of entries sent so far
+  uint16_t listYear;           // current year when the listing started
+  bool listFailed;             // listing could not be sent completely
 
   internalState cmdState, // state of ftp control connection
       transferState;      // state of ftp data connection
 };
 
+class FTPServer : public FTPCommon
+{
+  friend class FTPSession;
+
+public:
+  // contruct an instance of the FTP server using a
+  // given FS object, e.g. SPIFFS or LittleFS
+  FTPServer(FS &_FSImplementation);
+  virtual ~FTPServer();
+
+  // starts the FTP server with username and password,
+  // either one can be empty to enable anonymous ftp
+  // up to maxSessions clients (at most FTP_MAX_SESSIONS) are served concurrently
+  void begin(const String &uname, const String &pword, uint8_t maxSessions = FTP_MAX_SESSIONS);
+
+  // stops the FTP server
+  void stop();
+
+  // needs to be called frequently (e.g. in loop() )
+  // to process ftp requests
+  void handleFTP();
+
+  // number of currently connected clients
+  uint8_t sessionCount() const;
+
+  // set the range of data ports used in passive mode
+  // (default FTP_DATA_PORT_PASV .. FTP_DATA_PORT_PASV + FTP_PASV_PORT_COUNT - 1)
+  void setPassivePorts(uint16_t firstPort, uint16_t count = FTP_PASV_PORT_COUNT);
+
+  // statistics of the passive port pool
+  typedef struct
+  {
+    uint32_t requests;  // number of PASV requests
+    uint32_t exhausted; // number of PASV requests that found no free listener/port
+    uint8_t inUse;      // listeners currently waiting for a data connection
+    uint8_t highWater;  // max. listeners waiting at the same time
+  } PassiveStats;
+  const PassiveStats &passiveStats() const;
+
+  // optional cache of directory entries (name, size, type, last write time):
+  // listings fill it, SIZE, MDTM and CWD answer from it without opening the file.
+  // Changes made through the server invalidate the affected entries, files changed
+  // by the sketch itself are not noticed. 0 entries (default) disables the cache.
+  void setDirCache(uint8_t entries);
+
+  // statistics of the directory entry cache
+  typedef struct
+  {
+    uint8_t entries; // size of the cache
+    uint32_t hits;   // lookups answered from the cache
+    uint32_t misses; // lookups that had to ask the file system
+  } DirCacheStats;
+  const DirCacheStats &dirCacheStats() const;
+
+private:
+  FTPSession *getFreeSession();
+  WiFiServer *acquirePassivePort(FTPSession *session, uint16_t &port);
+  void releasePassivePort(FTPSession *session);
+
+  // directory entry cache, see setDirCache()
+  typedef struct
+  {
+    String path;      // full path of the entry, empty if unused
+    uint32_t size;
+    time_t lastWrite;
+    bool isDir;
+  } DirCacheEntry;
+  void dirCacheAdd(const String &path, uint32_t size, time_t lastWrite, bool isDir);
+  const DirCacheEntry *dirCacheFind(const String &path);
+  void dirCacheInvalidate(const String &path); // path and everything below it
+
+  // server specific
+  String _FTP_USER;                                    // usename
+  String _FTP_PASS;                                    // password
+  uint8_t _maxSessions = FTP_MAX_SESSIONS;             // max. number of concurrent sessions
+  FTPSession *sessions[FTP_MAX_SESSIONS] = {nullptr}; // session table, sessions are created on demand
+
+  // passive data port pool
+  typedef struct
+  {
+    WiFiServer *listener; // created on first use, re-used afterwards
+    FTPSession *owner;    // session which issued PASV, NULL if free
+    uint16_t port;        // port the listener is bound to
+  } PassiveListener;
+  PassiveListener pasvPool[FTP_PASV_LISTENERS] = {};
+  uint16_t _pasvFirstPort = FTP_DATA_PORT_PASV;
+  uint16_t _pasvPortCount = FTP_PASV_PORT_COUNT;
+  uint16_t pasvNextPort = 0; // round robin offset into the port range
+  PassiveStats pasvStats = {};
+
+  DirCacheEntry *dirCache = NULL;
+  uint8_t dirCacheNext = 0; // next entry to be replaced (round robin)
+  DirCacheStats dirStats = {};
+};
+
 #endif // FTP_SERVER_H
@@ -0,0 +1,104 @@
+/*
+   This is an example sketch to measure the transfer speed of the FTP Client
+   (and the FTP Server it talks to).
+
+   Please replace
+     YOUR_SSID and YOUR_PASS
+   with your WiFi's values and compile.
+
+   The sketch creates a test file of TEST_FILE_SIZE bytes, uploads it
+   (PUT, fs->net path) and downloads it again (GET, net->fs path) and
+   prints bytes/s for both directions.
+
+   Send B via Serial Monitor to run the benchmark again
+
+   This example is provided as Public Domain
+*/
+#include <ESP8266WiFi.h>
+#include <LittleFS.h>
+#include <FTPClient.h>
+
+#define TEST_FILE_NAME "/bench.bin"
+#define TEST_FILE_SIZE (256 * 1024)
+
+const char *ssid PROGMEM = "YOUR_SSID";
+const char *password PROGMEM = "YOUR_PASS";
+
+// tell the FTP Client to use LittleFS
+FTPClient ftpClient(LittleFS);
+
+// provide FTP servers credentials and servername
+FTPClient::ServerInfo ftpServerInfo("user", "password", "hostname_or_ip");
+
+void setup(void)
+{
+  Serial.begin(74880);
+  WiFi.begin(ssid, password);
+
+  bool fsok = LittleFS.begin();
+  Serial.printf_P(PSTR("FS init: %s\n"), fsok ? PSTR("ok") : PSTR("fail!"));
+
+  // Wait for connection
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+    Serial.printf_P(PSTR("."));
+  }
+  Serial.printf_P(PSTR("\nConnected to %s, IP address is %s\n"), ssid, WiFi.localIP().toString().c_str());
+
+  ftpClient.begin(ftpServerInfo);
+}
+
+bool makeTestFile()
+{
+  File f = LittleFS.open(F(TEST_FILE_NAME), "w");
+  if (!f)
+    return false;
+
+  uint8_t buf[512];
+  for (uint16_t i = 0; i < sizeof(buf); ++i)
+    buf[i] = i & 0xff;
+  for (uint32_t n = 0; n < TEST_FILE_SIZE; n += sizeof(buf))
+    f.write(buf, sizeof(buf));
+  f.close();
+  return true;
+}
+
+void runTransfer(FTPClient::TransferType direction, PGM_P name)
+{
+  uint32_t startTime = millis();
+  const FTPClient::Status &r = ftpClient.transfer(F(TEST_FILE_NAME), F(TEST_FILE_NAME), direction);
+  uint32_t deltaT = millis() - startTime;
+
+  if (r.result == FTPClient::OK && deltaT > 0)
+  {
+    Serial.printf_P(PSTR("%-4s %u bytes in %u ms: %u bytes/s\n"), name,
+                    TEST_FILE_SIZE, deltaT, (uint32_t)((uint64_t)TEST_FILE_SIZE * 1000 / deltaT));
+  }
+  else
+  {
+    Serial.printf_P(PSTR("%-4s failed, code: %d, descr=%s\n"), name, r.code, r.desc.c_str());
+  }
+}
+
+bool runBenchmark = true;
+
+void loop()
+{
+  if (runBenchmark)
+  {
+    runBenchmark = false;
+    if (!makeTestFile())
+    {
+      Serial.printf_P(PSTR("Cannot create test file\n"));
+      return;
+    }
+    // blocking transfers, the client calls handleFTP() itself
+    runTransfer(FTPClient::FTP_PUT, PSTR("PUT"));
+    runTransfer(FTPClient::FTP_GET, PSTR("GET"));
+    Serial.printf_P(PSTR("Send 'B' to run again\n"));
+  }
+
+  if (Serial.available() && Serial.read() == 'B')
+    runBenchmark = true;
+}
@@ -49,7 +49,7 @@ void setup(void)
   // setup the ftp server with username and password
   // ports are defined in FTPCommon.h, default is
   //   21 for the control connection
-  //   50009 for the data connection (passive mode by default)
+  //   50009..50024 for the data connections (passive mode by default)
   ftpSrv.begin(F("ftp"), F("ftp")); //username, password for ftp.  set ports in ESP8266FtpServer.h  (default 21, 50009 for PASV)
 }
 
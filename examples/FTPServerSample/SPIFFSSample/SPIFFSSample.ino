@@ -53,7 +53,7 @@ void setup(void)
   // setup the ftp server with username and password
   // ports are defined in FTPCommon.h, default is
   //   21 for the control connection
-  //   50009 for the data connection (passive mode by default)
+  //   50009..50024 for the data connections (passive mode by default)
   ftpSrv.begin(F("ftp"), F("ftp"));
 }
 